@@ -0,0 +1,184 @@
+#ifndef IFPP_ARENA_H
+#define IFPP_ARENA_H
+
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+namespace ifpp {
+
+/*
+Allocator for objects of type T, which are created and destroyed by the million during compilation.
+
+Blocks for the objects are carved from large chunks. Every thread keeps its own list of free blocks,
+so allocating and freeing do not take any locks most of the time. A block can be freed by another thread than
+the one which allocated it, it simply goes to the list of that thread. Threads which free more than they allocate
+hand batches of blocks back to the arena, for the threads which allocate. So do threads which finish.
+
+Chunks are never freed one by one, only all at once by release, when no objects are left.
+*/
+template<class T>
+class Arena {
+public:
+	static void * allocate() {
+		Cache & cache = localCache();
+		if (!cache.head) refill(cache);
+
+		Block * b = cache.head;
+		cache.head = b->next;
+		--cache.count;
+		++cache.allocations;
+		return b;
+	}
+
+	static void deallocate(void * p) {
+		Cache & cache = localCache();
+		Block * b = static_cast<Block *>(p);
+		b->next = cache.head;
+		cache.head = b;
+		++cache.count;
+
+		if (cache.count >= 2 * BATCH) giveBack(cache, BATCH);
+	}
+
+	/*
+	Frees all chunks, if there are no objects left. Returns the number of objects still alive,
+	nothing is freed if there are any; the caller should complain, as somebody forgot to delete them.
+	Must not be called while other threads use the arena.
+
+	Threads which have finished gave their free blocks back, so once this thread does too,
+	all blocks should be with the arena. Those which are not are used by objects.
+	*/
+	static size_t release() {
+		Cache & cache = localCache();
+		if (cache.count > 0) giveBack(cache, cache.count);
+
+		Pool & p = pool();
+		std::lock_guard<std::mutex> lock(p.mutex);
+		if (p.outstanding != 0) return p.outstanding;
+
+		for (auto c : p.chunks) delete[] c;
+		p.chunks.clear();
+		p.batches.clear();
+		// Threads still holding lists into the freed chunks drop them when they notice the new generation.
+		++p.generation;
+		return 0;
+	}
+
+	/*
+	Number of objects allocated so far, for statistics.
+	Counts of other threads are only included once they have finished.
+	*/
+	static unsigned long long allocations() {
+		Pool & p = pool();
+		std::lock_guard<std::mutex> lock(p.mutex);
+		return p.allocations + localCache().allocations;
+	}
+
+	// Bytes taken by chunks.
+	static size_t reserved() {
+		Pool & p = pool();
+		std::lock_guard<std::mutex> lock(p.mutex);
+		return p.chunks.size() * CHUNK * sizeof(Block);
+	}
+
+private:
+	union Block {
+		Block * next;
+		alignas(T) char data[sizeof(T)];
+	};
+
+	// Blocks per chunk, and per batch passed between threads.
+	static const size_t CHUNK = 1024;
+	static const size_t BATCH = 256;
+
+	struct Batch {
+		Block * head;
+		size_t count;
+	};
+
+	struct Pool {
+		Pool() : mutex(), chunks(), batches(), outstanding(0), allocations(0), generation(0) {}
+		Pool(const Pool &) = delete;
+		Pool & operator=(const Pool &) = delete;
+		~Pool() { for (auto c : chunks) delete[] c; }
+
+		std::mutex mutex;
+		std::vector<Block *> chunks;
+		std::vector<Batch> batches;
+		size_t outstanding; // Blocks held by threads, free in their lists or used by objects.
+		unsigned long long allocations; // Of finished threads.
+		std::atomic<unsigned> generation;
+	};
+
+	struct Cache {
+		Cache() : head(NULL), count(0), allocations(0), generation(pool().generation) {}
+		Cache(const Cache &) = delete;
+		Cache & operator=(const Cache &) = delete;
+		~Cache() {
+			if (count > 0 && generation == pool().generation) giveBack(*this, count);
+			Pool & p = pool();
+			std::lock_guard<std::mutex> lock(p.mutex);
+			p.allocations += allocations;
+		}
+
+		Block * head;
+		size_t count;
+		unsigned long long allocations;
+		unsigned generation;
+	};
+
+	static Pool & pool() {
+		static Pool p;
+		return p;
+	}
+
+	static Cache & localCache() {
+		static thread_local Cache cache;
+		if (cache.generation != pool().generation) {
+			cache.head = NULL;
+			cache.count = 0;
+			cache.generation = pool().generation;
+		}
+		return cache;
+	}
+
+	static void refill(Cache & cache) {
+		Pool & p = pool();
+		std::lock_guard<std::mutex> lock(p.mutex);
+
+		if (!p.batches.empty()) {
+			cache.head = p.batches.back().head;
+			cache.count = p.batches.back().count;
+			p.batches.pop_back();
+		} else {
+			Block * chunk = new Block[CHUNK];
+			p.chunks.push_back(chunk);
+			for (size_t i = 0; i + 1 < CHUNK; ++i) chunk[i].next = &chunk[i + 1];
+			chunk[CHUNK - 1].next = NULL;
+			cache.head = chunk;
+			cache.count = CHUNK;
+		}
+		p.outstanding += cache.count;
+	}
+
+	// Gives the first n free blocks of the thread back to the arena.
+	static void giveBack(Cache & cache, size_t n) {
+		Batch batch{cache.head, n};
+		Block * last = cache.head;
+		for (size_t i = 1; i < n; ++i) last = last->next;
+		cache.head = last->next;
+		cache.count -= n;
+		last->next = NULL;
+
+		Pool & p = pool();
+		std::lock_guard<std::mutex> lock(p.mutex);
+		p.batches.push_back(batch);
+		p.outstanding -= n;
+	}
+};
+
+}
+
+#endif
\ No newline at end of file
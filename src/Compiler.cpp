@@ -1,10 +1,26 @@
 #include "Compiler.h"
+#include "RuleOperations.h"
+#include "Scheduler.h"
+#include "Spill.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
 
 namespace ifpp {
 
 /*
 Appends all rules from the second filter to the first. Clears the second filter.
-Currently there is no optimization being done between different sections - this could be added?
+No optimization is done between different sections here; rules shadowed by earlier sections
+are removed by the writer of the output, if asked to (see ShadowIndex).
 */
 static void AppendFilter(FilterNative & first, const FilterNative & second) {
 	first.reserve(first.size() + second.size());
@@ -12,163 +28,823 @@ static void AppendFilter(FilterNative & first, const FilterNative & second) {
 }
 
 /*
-TODO: crop the old rule by the conditions in modifier
-to optimize situations where the old rule does not match anything after all mods.
+Runs task(i) for every i in [0, count) as separate tasks of the scheduler.
+If any tasks throw, the exception of the lowest index is rethrown once all of them have finished.
 */
-static RuleNative * ModifyRule(RuleNative * ruleOld, const RuleNative * modifier) {
-	auto * ruleNew = ruleOld->clone();
-	for (const auto & c : modifier->conditions) {
-		ruleNew->addCondition(c.second);
-		if (ruleNew->useless) break;
+static void ParallelFor(Scheduler & scheduler, size_t count, const std::function<void(size_t)> & task) {
+	std::vector<std::exception_ptr> errors(count);
+
+	TaskGroup tasks(scheduler);
+	for (size_t i = 0; i < count; ++i) {
+		tasks.spawn([&task, &errors, i]() {
+			try {
+				task(i);
+			} catch (...) {
+				errors[i] = std::current_exception();
+			}
+		});
 	}
+	tasks.wait();
 
-	if (!ruleNew->useless) {
-		for (const auto & a : modifier->actions) {
-			ruleNew->addAction(a.second);
-		}
-		if (RuleSubset(ruleOld, ruleNew)) ruleOld->useless = true;
+	for (const auto & e : errors) {
+		if (e) std::rethrow_exception(e);
+	}
+}
+
+// Products with fewer rule pairs than this are not worth splitting between threads.
+static const size_t PARALLEL_MIN_PAIRS = 4096;
+
+/*
+Computes a cartesian product of the rules in inFilter with a modifier of the given size.
+step(out, rule) handles a single rule of inFilter and appends whatever it produces to out.
+For a chain of modifiers, the size is the number of combinations of their rules.
+
+For large products, inFilter is split into chunks which are processed in parallel, each into its own slice.
+The slices are joined in the original order, so the result is the same as processing the rules one by one.
+
+The step gets a reference to the rule in inFilter. If it takes ownership of the rule, it sets the reference to NULL,
+so that the caller knows which rules are left to delete if a step throws.
+*/
+template<class Step>
+static void ProductFilter(RuleRun & outRules, FilterNative & inFilter, size_t modifierSize,
+	Scheduler & scheduler, Step step) {
+
+	if (scheduler.threads() <= 1 || inFilter.size() < 2 || inFilter.size() * modifierSize < PARALLEL_MIN_PAIRS) {
+		for (auto & r : inFilter) step(outRules, r);
+		return;
+	}
+
+	// A few chunks per thread even out the load, as some rules produce many more rules than others.
+	const size_t numChunks = std::min(inFilter.size(), static_cast<size_t>(scheduler.threads()) * 4);
+	std::vector<RuleRun> slices;
+	slices.reserve(numChunks);
+	for (size_t i = 0; i < numChunks; ++i) slices.emplace_back(outRules.spillManager());
+
+	ParallelFor(scheduler, numChunks, [&](size_t i) {
+		const size_t from = inFilter.size() * i / numChunks;
+		const size_t to = inFilter.size() * (i + 1) / numChunks;
+		for (size_t j = from; j < to; ++j) step(slices[i], inFilter[j]);
+	});
+
+	for (auto & slice : slices) outRules.append(slice);
+}
+
+/*
+Adds the conditions of the modifier to the rule, and its actions if the rule still matches anything.
+*/
+static void ApplyModifier(RuleNative & rule, const RuleNative * modifier) {
+	rule.addConditions(*modifier);
+	if (!rule.useless) rule.addActions(*modifier);
+}
+
+static size_t FinalLists(const RuleNative * rule) {
+	return std::count_if(rule->lists.begin(), rule->lists.end(), [](const ListCondition & c) { return c.tags & TAG_FINAL; });
+}
+
+/*
+True if the copy of a rule modified by modifier[i] gets the same actions as the rule itself,
+and no later rule of the modifier matches any of its items.
+The copy must not have any new Final conditions either, as those keep later modifiers from narrowing it
+the way they narrow the rule.
+*/
+static bool Unchanged(const RuleNative * ruleOld, const RuleNative * ruleNew, const FilterNative & modifier, size_t i) {
+	if (!SameActions(ruleOld, ruleNew)) return false;
+	if (ruleNew->finalMask != ruleOld->finalMask || FinalLists(ruleNew) != FinalLists(ruleOld)) return false;
+	for (size_t j = i + 1; j < modifier.size(); ++j) {
+		if (!RuleDisjoint(ruleNew, modifier[j])) return false;
+	}
+	return true;
+}
+
+/*
+Makes a copy of the old rule modified by modifier[i].
+Rules which turn out useless are not deleted right away, but overwritten by the next copy made in the same loop.
+The spare rule is either empty or such a rule.
+
+The modified copy comes before the old rule, so the old rule only gets the items which the copy does not match.
+If asked to (crop), it is cropped to the difference, where that can be computed; often it does not match anything after all mods.
+Otherwise it is only dropped if the copy matches everything it does.
+
+If the old rule is also kept after its copies (keepOld), a copy which does not change any action is left out
+instead, as long as no later rule of the modifier takes its items: they fall through to the old rule,
+which gives them the same actions. The copy is returned as useless then. Also only if asked to,
+as this relies on the same assumptions as cropping.
+*/
+static RulePtr ModifyRule(RuleNative * ruleOld, const FilterNative & modifier, size_t i, RulePtr & spare, bool crop, bool keepOld) {
+	RulePtr ruleNew;
+	if (spare) {
+		ruleNew = std::move(spare);
+		*ruleNew = *ruleOld;
+	} else {
+		ruleNew.reset(ruleOld->clone());
+	}
+	ApplyModifier(*ruleNew, modifier[i]);
+	if (ruleNew->useless) return ruleNew;
+
+	if (crop && keepOld && Unchanged(ruleOld, ruleNew.get(), modifier, i)) {
+		ruleNew->useless = true;
+	} else if (crop) {
+		RuleDifference(*ruleOld, ruleNew.get());
+	} else if (RuleSubset(ruleOld, ruleNew.get())) {
+		ruleOld->useless = true;
 	}
 
 	return ruleNew;
 }
 
 /*
-Appends a rule modified by the modifier to the filter.
+The same for the last use of the old rule, which is modified in place instead of copied.
+Nobody looks at the old rule afterwards, so it does not need to be marked useless.
+*/
+static RulePtr ModifyRule(RulePtr ruleOld, const RuleNative * modifier) {
+	ApplyModifier(*ruleOld, modifier);
+	return ruleOld;
+}
+
+static void PushUseful(RuleRun & outRules, RulePtr rule, RulePtr & spare) {
+	if (!rule->useless) outRules.push(std::move(rule));
+	else spare = std::move(rule);
+}
+
+/*
+Appends a rule modified by the modifier to the rules.
+Pairs which surely do not match anything are skipped without copying the rule. Returns the number of those.
+*/
+static size_t ModifyRule(RuleRun & outRules, RuleNative * ruleOld, const FilterNative & modifier, bool crop) {
+	size_t rejected = 0;
+	RulePtr spare;
+	for (size_t i = 0; i < modifier.size(); ++i) {
+		if (RuleDisjoint(ruleOld, modifier[i])) ++rejected;
+		else PushUseful(outRules, ModifyRule(ruleOld, modifier, i, spare, crop, false), spare);
+	}
+	return rejected;
+}
+
+/*
+The same, but takes ownership of the old rule, which becomes the last modified rule.
+*/
+static size_t ModifyRule(RuleRun & outRules, RulePtr ruleOld, const FilterNative & modifier, bool crop) {
+	if (modifier.empty()) return 0;
+
+	size_t rejected = 0;
+	RulePtr spare;
+	for (size_t i = 0; i + 1 < modifier.size(); ++i) {
+		if (RuleDisjoint(ruleOld.get(), modifier[i])) ++rejected;
+		else PushUseful(outRules, ModifyRule(ruleOld.get(), modifier, i, spare, crop, false), spare);
+	}
+	if (RuleDisjoint(ruleOld.get(), modifier.back())) ++rejected;
+	else PushUseful(outRules, ModifyRule(std::move(ruleOld), modifier.back()), spare);
+	return rejected;
+}
+
+/*
+Parts of a top-level block, for estimating how much of it is done. A whole block is BLOCK_WORK.
+Expanding the rules of the block splits its work between them, every rule between its modified copies, and so on.
+The work of a rule is done once it is output, or dropped.
+*/
+typedef unsigned long long Work;
+static const Work BLOCK_WORK = 1ULL << 40;
+
+/*
+Everything shared by the tasks compiling one filter (or one block, for callers compiling blocks one at a time).
+*/
+struct CompileContext {
+	typedef std::chrono::steady_clock Clock;
+
+	CompileContext(SpillManager * s, const CompilerOptions & options, size_t blocks) :
+		spill(s), cancel(options.cancel), progress(options.progress), start(Clock::now()),
+		blocksDone(0), blocksTotal(blocks), workDone(0), rulesGenerated(0), pairsRejected(0), reportMutex(), lastReport(start) {}
+	CompileContext(const CompileContext &) = delete;
+	CompileContext & operator=(const CompileContext &) = delete;
+
+	void check();
+	void report(bool force);
+
+	// Counts rules output by a top-level block, and the work they finish.
+	void output(unsigned long long rules, Work work) {
+		if (rules > 0) rulesGenerated += rules;
+		if (work > 0) workDone += work;
+	}
+
+	SpillManager * spill;
+	const CancelToken * cancel;
+	const ProgressCallback & progress;
+
+	Clock::time_point start;
+	std::atomic<size_t> blocksDone;
+	size_t blocksTotal;
+	std::atomic<Work> workDone;
+	std::atomic<unsigned long long> rulesGenerated; // Output by the top-level blocks so far.
+	std::atomic<unsigned long long> pairsRejected; // Rules and modifier rules found disjoint before modifying.
+
+	std::mutex reportMutex;
+	Clock::time_point lastReport;
+};
+
+// Progress is reported at most this often while compiling, except after every top-level block.
+static const std::chrono::milliseconds PROGRESS_INTERVAL(200);
+
+/*
+Called regularly during the compilation: throws if it was cancelled, and reports progress now and then.
+Looking at the clock is not free, so only every so many calls do it.
+*/
+void CompileContext::check() {
+	if (cancel && cancel->cancelled()) throw CompileCancelled();
+
+	if (progress) {
+		static thread_local unsigned calls = 0;
+		if (++calls % 1024 == 0) report(false);
+	}
+}
+
+/*
+Calls the progress callback, unless it was called recently (or another thread is calling it right now).
+The estimated time remaining assumes that the remaining work takes as long as the work done so far.
+Parts of blocks count, so that there is an estimate while the first block, or a single large one, is compiled.
+*/
+void CompileContext::report(bool force) {
+	if (!progress) return;
+
+	std::unique_lock<std::mutex> lock(reportMutex, std::defer_lock);
+	if (force) lock.lock();
+	else if (!lock.try_lock()) return;
+
+	auto now = Clock::now();
+	if (!force && now - lastReport < PROGRESS_INTERVAL) return;
+	lastReport = now;
+
+	CompileProgress p;
+	p.blocksDone = blocksDone;
+	p.blocksTotal = blocksTotal;
+	p.blocksWorked = std::min(static_cast<double>(workDone) / BLOCK_WORK, static_cast<double>(blocksTotal));
+	p.rulesGenerated = rulesGenerated;
+	p.secondsElapsed = std::chrono::duration<double>(now - start).count();
+	p.secondsRemaining = p.blocksWorked > 0
+		? p.secondsElapsed * (p.blocksTotal - p.blocksWorked) / p.blocksWorked
+		: -1;
+	progress(p);
+}
+
+/*
+A modifier which is part of a lazy product.
+Owns its rules, and is shared by all the products it applies to.
+*/
+struct ModifierFactor {
+	ModifierFactor(FilterNative & r, bool req) : rules(), required(req) { rules.swap(r); }
+	ModifierFactor(const ModifierFactor &) = delete;
+	ModifierFactor & operator=(const ModifierFactor &) = delete;
+	~ModifierFactor() { for (auto r : rules) delete r; }
+
+	FilterNative rules;
+	bool required;
+};
+typedef std::vector<std::shared_ptr<const ModifierFactor> > FactorChain;
+
+/*
+Rules together with a chain of modifiers which still have to be applied to them, in order.
+*/
+struct ProductSegment {
+	explicit ProductSegment(SpillManager * spill) : rules(spill), factors() {}
+
+	RuleRun rules;
+	FactorChain factors;
+};
+
+/*
+A filter kept in a factorized form: a sequence of segments, each a product of some rules and a chain of modifiers.
+Stacked modifiers do not multiply the number of rules until the product is expanded,
+which happens only when we need the actual rules - for the output, or to apply condition groups.
+
+Whatever is appended after a modifier is not changed by it, so it starts a new segment.
+Nested blocks hand their products to their parents unexpanded; modifiers of the parents are added to their chains.
+The rules of the segments, and everything expanded from them, spill to disk if there is a spill manager.
+*/
+struct FilterProduct {
+	FilterProduct(CompileContext & c, bool crop) : segments(), context(c), cropRules(crop) {}
+	FilterProduct(FilterProduct && other) : segments(std::move(other.segments)), context(other.context), cropRules(other.cropRules) {}
+	FilterProduct(const FilterProduct &) = delete;
+	FilterProduct & operator=(const FilterProduct &) = delete;
+	~FilterProduct() { clear(); }
+
+	void clear();
+	bool surelyNonEmpty() const;
+	void append(FilterNative & rules);
+	void append(RuleRun & rules);
+	void append(FilterProduct & other);
+	void modify(const std::shared_ptr<const ModifierFactor> & factor);
+	void expand(RuleRun & outRules, Scheduler & scheduler, bool output = false);
+
+	std::vector<ProductSegment> segments;
+	CompileContext & context;
+
+	// Whether rules are cropped by their modified copies, and unchanged copies left out, see ModifyRule. The same for a whole top-level block.
+	bool cropRules;
+};
+
+void FilterProduct::clear() {
+	segments.clear();
+}
+
+/*
+True if the product contains some rules, which we can tell without expanding it.
+A modifier which is not Required never removes all the rules: a rule is only dropped
+when a modified copy of it is kept. Unless the rule did not match anything in the first place.
+*/
+bool FilterProduct::surelyNonEmpty() const {
+	for (const auto & seg : segments) {
+		bool required = false;
+		for (const auto & f : seg.factors) {
+			if (f->required) required = true;
+		}
+		if (required) continue;
+
+		if (seg.factors.empty() ? !seg.rules.empty() : seg.rules.anyUseful()) return true;
+	}
+	return false;
+}
+
+/*
+Takes ownership of the rules and clears the vector.
+*/
+void FilterProduct::append(FilterNative & rules) {
+	if (rules.empty()) return;
+
+	if (segments.empty() || !segments.back().factors.empty()) {
+		segments.push_back(ProductSegment(context.spill));
+	}
+	segments.back().rules.append(rules);
+}
+
+/*
+Takes ownership of the rules and leaves the run empty.
+*/
+void FilterProduct::append(RuleRun & rules) {
+	if (rules.empty()) return;
+
+	if (segments.empty() || !segments.back().factors.empty()) {
+		segments.push_back(ProductSegment(context.spill));
+	}
+	segments.back().rules.append(rules);
+}
+
+/*
+Takes over all segments of the other product.
 */
-static void ModifyRule(FilterNative & outFilter, RuleNative * ruleOld, const FilterNative & modifier) {
-	for (const auto modOld : modifier) {
-		const auto ruleNew = ModifyRule(ruleOld, modOld);
+void FilterProduct::append(FilterProduct & other) {
+	for (auto & seg : other.segments) {
+		if (seg.factors.empty()) {
+			append(seg.rules);
+		} else {
+			segments.push_back(std::move(seg));
+		}
+	}
+	other.segments.clear();
+}
 
-		if (!ruleNew->useless) outFilter.push_back(ruleNew);
-		else delete ruleNew;
+/*
+Modifies the entire product by another modifier.
+*/
+void FilterProduct::modify(const std::shared_ptr<const ModifierFactor> & factor) {
+	for (auto & seg : segments) {
+		seg.factors.push_back(factor);
 	}
 }
 
 /*
-Modifies the first filter by the second (cartesian product).
-Few optimizations are preformed right now, TODO.
+Applies the rest of the chain of modifiers to a single rule, depth-first.
+A partial product which does not match anything is dropped before any further modifiers are applied to it.
+
+The rules come out in the same order as if we applied every modifier to the entire filter, one after another:
+for every rule, first all of its modified copies, then the rule itself if it is still needed.
+
+If the rules are the output of a top-level block, they are counted as they come out, together with the work
+the rule stands for. It is split evenly between its modified copies, and the rule itself unless the modifier is Required.
 */
-static void ModifyFilter(FilterNative & outFilter, const FilterNative & modifier, bool required) {
-	/*if (outFilter.empty()) {
-		AppendFilter(outFilter, modifier);
+static void ExpandRule(RuleRun & outRules, RulePtr rule, const FactorChain & factors, size_t next,
+	CompileContext & context, bool crop, bool output, Work work) {
+
+	if (next == factors.size()) {
+		context.check();
+		outRules.push(std::move(rule));
+		if (output) context.output(1, work);
 		return;
-	}*/
+	}
 
-	FilterNative inFilter;
-	inFilter.swap(outFilter);
+	const ModifierFactor & factor = *factors[next];
+	const size_t numMods = factor.rules.size();
+	const size_t parts = factor.required ? numMods : numMods + 1;
+	const Work share = parts > 0 ? work / parts : 0;
+	Work left = work; // The last part gets what is left after rounding.
+	size_t rejected = 0;
+	RulePtr spare;
+	for (size_t i = 0; i < numMods; ++i) {
+		const Work part = i + 1 == parts ? left : share;
+		left -= part;
+
+		if (RuleDisjoint(rule.get(), factor.rules[i])) {
+			++rejected;
+			if (output) context.output(0, part);
+			continue;
+		}
+
+		// If the rule itself is dropped, the last modified copy can take its place.
+		RulePtr ruleNew = factor.required && i + 1 == numMods ? ModifyRule(std::move(rule), factor.rules[i])
+			: ModifyRule(rule.get(), factor.rules, i, spare, crop, !factor.required);
 
-	for (auto ruleOld : inFilter) {
-		ModifyRule(outFilter, ruleOld, modifier);
+		if (!ruleNew->useless) {
+			ExpandRule(outRules, std::move(ruleNew), factors, next + 1, context, crop, output, part);
+		} else {
+			spare = std::move(ruleNew);
+			if (output) context.output(0, part);
+		}
+	}
+	if (rejected > 0) context.pairsRejected += rejected;
 
-		if (!required && !ruleOld->useless) outFilter.push_back(ruleOld);
-		else delete ruleOld;
+	if (rule && !factor.required && !rule->useless) {
+		ExpandRule(outRules, std::move(rule), factors, next + 1, context, crop, output, left);
+	} else if (output) {
+		context.output(0, left);
 	}
 }
 
 /*
-Compiles a single top-level IFPP rule and appends the native rules to a filter.
+Expands the product into actual rules, appending them to the run. Leaves the product empty.
+Spilled rules are expanded a chunk at a time as they are read back.
+
+If the rules are the output of a top-level block, they are counted for the progress as they come out,
+and the work of the block is split evenly between the rules of the product; see ExpandRule.
 */
-static void CompileBlock(FilterNative & outFilter, const Block * inBlock, const RuleNative * baseRule = NULL) {
+void FilterProduct::expand(RuleRun & outRules, Scheduler & scheduler, bool output) {
+	size_t numRules = 0;
+	for (const auto & seg : segments) numRules += seg.rules.size();
+	const Work share = numRules > 0 ? BLOCK_WORK / numRules : 0;
+	if (output) context.output(0, BLOCK_WORK - share * numRules);
+
+	for (auto & seg : segments) {
+		if (seg.factors.empty()) {
+			if (output) context.output(seg.rules.size(), share * seg.rules.size());
+			outRules.append(seg.rules);
+		} else {
+			// Number of combinations of the modifiers, only needed up to the point where it is worth going parallel.
+			size_t combinations = 1;
+			for (const auto & f : seg.factors) {
+				if (combinations < PARALLEL_MIN_PAIRS) combinations *= f->rules.size() + 1;
+			}
+
+			seg.rules.consume([&](FilterNative & chunk) {
+				// ExpandRule takes ownership of the rules.
+				ProductFilter(outRules, chunk, combinations, scheduler, [&](RuleRun & out, RuleNative *& r) {
+					RulePtr rule(r);
+					r = NULL;
+					ExpandRule(out, std::move(rule), seg.factors, 0, context, cropRules, output, share);
+				});
+				chunk.clear();
+			});
+		}
+	}
+	segments.clear();
+}
 
-	RuleNative * base = baseRule ? baseRule->clone() : new RuleNative();
+/*
+Compiles a single IFPP block into a (lazy) product of native rules.
+Takes ownership of the base rule, which holds the conditions and actions inherited from parent blocks.
+
+Nested blocks only depend on the base rule at the point where they appear.
+So first we go through the commands, building the base rule and spawning a task for every nested block,
+each with its own copy of the base rule at that point. Siblings thus compile in parallel.
+Then the compiled blocks are combined in their original order, which is where they actually interact.
+*/
+static void CompileBlock(FilterProduct & outProduct, const Block * inBlock, Scheduler & scheduler, RulePtr base) {
+	struct SubBlock {
+		const Block * block;
+		RulePtr base; // Copy of the base rule at the point of the block, if it differs from the final base.
+		bool afterCommands; // True if there are conditions or actions between this block and the previous one.
+		FilterProduct product;
+	};
+	std::vector<SubBlock> subBlocks;
 	std::vector<FilterNative> conditionGroups;
 
-	for (const auto c : outFilter) delete c;
-	outFilter.clear();
+	outProduct.clear();
+	outProduct.context.check();
 
-	bool hasDefault = false;
+	bool hasCommands = false;
+
+	// Modifiers after the last condition or action can use the final base rule instead of a copy.
+	size_t commandsLeft = 0;
+	for (const auto c : inBlock->commands) {
+		if (c->comType != COM_BLOCK) ++commandsLeft;
+	}
 
 	for (const auto c : inBlock->commands) {
 		switch (c->comType) {
 			case COM_CONDITION:
 				base->addCondition(static_cast<Condition *>(c));
-				hasDefault = true;
+				hasCommands = true;
+				--commandsLeft;
 				break;
 
 			case COM_ACTION:
 				base->addAction(static_cast<Action *>(c));
-				hasDefault = true;
+				hasCommands = true;
+				--commandsLeft;
 				break;
 
 			case COM_BLOCK: {
-				const auto block = static_cast<Block *>(c);
-				FilterNative blockFilter;
-				CompileBlock(blockFilter, block,
-					block->blockType == BLOCK_MODIFIER ? NULL : base);
+				const Block * block = static_cast<Block *>(c);
+				RulePtr blockBase(block->blockType != BLOCK_MODIFIER || commandsLeft > 0 ? base->clone() : NULL);
+				subBlocks.push_back(SubBlock{block, std::move(blockBase), hasCommands, FilterProduct(outProduct.context, outProduct.cropRules)});
+				hasCommands = false;
+				break;
+			}
 
-				switch (block->blockType) {
-					case BLOCK_RULE:
-					case BLOCK_GROUP:
-						AppendFilter(outFilter, blockFilter);
-						break;
+			default:
+				throw UnhandledCase("Command type", __FILE__, __LINE__);
+		}
+	}
 
-					case BLOCK_CONDITIONGROUP:
-						// Store all the condition groups first, later we will duplicate the entire rule for each CG.
-						conditionGroups.push_back(blockFilter);
-						break;
+	TaskGroup tasks(scheduler);
+	for (auto & sb : subBlocks) {
+		if (sb.block->blockType == BLOCK_MODIFIER) {
+			// Modifiers do not inherit anything, we keep the base for when there is nothing to modify.
+			tasks.spawn([&sb, &scheduler]() { CompileBlock(sb.product, sb.block, scheduler, RulePtr(new RuleNative())); });
+		} else {
+			// The nested block takes ownership of its base.
+			RuleNative * blockBase = sb.base.release();
+			tasks.spawn([&sb, &scheduler, blockBase]() { CompileBlock(sb.product, sb.block, scheduler, RulePtr(blockBase)); });
+		}
+	}
+	tasks.wait();
 
-					case BLOCK_MODIFIER:
-						if (outFilter.empty()) {
-							outFilter.push_back(base->clone());
-							hasDefault = false;
-						}
-					
-						ModifyFilter(outFilter, blockFilter, block->hasTag(TAG_REQUIRED));
-						/*
-						if (hasDefault) {
-							// TODO: comment this better.
-							RuleNative * baseCropped = base->clone();
-							ModifyRule(outFilter, baseCropped, blockFilter);
-							if (baseCropped->useless) hasDefault = false;
-							delete baseCropped;
-						}
-						if (block->hasTag(TAG_REQUIRED)) hasDefault = false;
-						*/
-						break;
+	bool hasDefault = false;
+
+	for (auto & sb : subBlocks) {
+		if (sb.afterCommands) hasDefault = true;
 
-					case BLOCK_DEFAULT:
-						AppendFilter(outFilter, blockFilter);
+		switch (sb.block->blockType) {
+			case BLOCK_RULE:
+			case BLOCK_GROUP:
+				outProduct.append(sb.product);
+				break;
+
+			case BLOCK_CONDITIONGROUP:
+				// Store all the condition groups first, later we will duplicate the entire rule for each CG.
+				{
+					RuleRun cgRules(outProduct.context.spill);
+					sb.product.expand(cgRules, scheduler);
+					conditionGroups.push_back(FilterNative());
+					cgRules.release(conditionGroups.back());
+				}
+				break;
+
+			case BLOCK_MODIFIER: {
+				if (!outProduct.surelyNonEmpty()) {
+					// We need to know if there is anything to modify.
+					RuleRun outRules(outProduct.context.spill);
+					outProduct.expand(outRules, scheduler);
+					if (outRules.empty()) {
+						outRules.push(sb.base ? std::move(sb.base) : RulePtr(base->clone()));
 						hasDefault = false;
-						break;
+					}
+					outProduct.append(outRules);
+				}
 
-					default:
-						throw UnhandledCase("Block type", __FILE__, __LINE__);
+				// Every rule is modified by all of the modifier, so its rules have to be in memory.
+				RuleRun modifierRules(outProduct.context.spill);
+				sb.product.expand(modifierRules, scheduler);
+				FilterNative modifier;
+				modifierRules.release(modifier);
+				outProduct.modify(std::make_shared<const ModifierFactor>(modifier, sb.block->hasTag(TAG_REQUIRED)));
+				/*
+				if (hasDefault) {
+					// TODO: comment this better.
+					RuleNative * baseCropped = base->clone();
+					ModifyRule(outFilter, baseCropped, blockFilter);
+					if (baseCropped->useless) hasDefault = false;
+					delete baseCropped;
 				}
+				if (block->hasTag(TAG_REQUIRED)) hasDefault = false;
+				*/
 				break;
 			}
 
+			case BLOCK_DEFAULT:
+				outProduct.append(sb.product);
+				hasDefault = false;
+				break;
+
 			default:
-				throw UnhandledCase("Command type", __FILE__, __LINE__);
+				throw UnhandledCase("Block type", __FILE__, __LINE__);
 		}
+
+		sb.base.reset();
 	}
 
+	if (hasCommands) hasDefault = true;
+
 	if (!inBlock->hasTag(TAG_NODEFAULT) && hasDefault) {
-		outFilter.push_back(base);
+		FilterNative defaultRule(1, base.release());
+		outProduct.append(defaultRule);
 	} else {
-		delete base;
+		base.reset();
 	}
 
 	if (!conditionGroups.empty()) {
-		FilterNative filterBase;
-		filterBase.swap(outFilter);
+		// Every rule is duplicated for each condition group, this needs the actual rules.
+		// ModifyRule can mark the rules of the base as useless, which affects the following condition groups.
+		RuleRun filterBase(outProduct.context.spill);
+		outProduct.expand(filterBase, scheduler);
+
+		RuleRun outRules(outProduct.context.spill);
+		for (size_t i = 0; i + 1 < conditionGroups.size(); ++i) {
+			const FilterNative & cg = conditionGroups[i];
+			filterBase.update([&](FilterNative & chunk) {
+				ProductFilter(outRules, chunk, cg.size(), scheduler, [&](RuleRun & out, RuleNative * r) {
+					outProduct.context.check();
+					size_t rejected = ModifyRule(out, r, cg, outProduct.cropRules);
+					if (rejected > 0) outProduct.context.pairsRejected += rejected;
+				});
+			});
+		}
+
+		// The base is not needed after the last condition group, so its rules are modified in place.
+		const FilterNative & cgLast = conditionGroups.back();
+		filterBase.consume([&](FilterNative & chunk) {
+			ProductFilter(outRules, chunk, cgLast.size(), scheduler, [&](RuleRun & out, RuleNative *& r) {
+				RulePtr rule(r);
+				r = NULL;
+				outProduct.context.check();
+				size_t rejected = ModifyRule(out, std::move(rule), cgLast, outProduct.cropRules);
+				if (rejected > 0) outProduct.context.pairsRejected += rejected;
+			});
+			chunk.clear();
+		});
 
 		for (const auto & cg : conditionGroups) {
-			for (auto r : filterBase) {
-				ModifyRule(outFilter, r, cg);
-			}
 			for (auto r : cg) delete r;
 		}
 
-		for (auto r : filterBase) delete r;
+		outProduct.append(outRules);
 	}
 }
 
+typedef unsigned long long RuleCount;
+static const RuleCount RULECOUNT_MAX = ULLONG_MAX;
+
+// Rule counts saturate instead of overflowing; the estimates for bad filters do get that large.
+static RuleCount AddCount(RuleCount a, RuleCount b) {
+	return a > RULECOUNT_MAX - b ? RULECOUNT_MAX : a + b;
+}
+
+static RuleCount MulCount(RuleCount a, RuleCount b) {
+	if (a == 0 || b == 0) return 0;
+	return a > RULECOUNT_MAX / b ? RULECOUNT_MAX : a * b;
+}
+
+static std::string CountString(RuleCount c) {
+	std::stringstream ss;
+	if (c == RULECOUNT_MAX) ss << "more than ";
+	ss << c;
+	return ss.str();
+}
+
 /*
-Compiles an IFPP filter into a native filter.
+Describes a nested block for messages, e.g. "Rule at line 12 in Group at line 3".
 */
-void Compiler::Compile(FilterNative & outFilter, const FilterIFPP & inFilter) {
-	for (const auto r : outFilter) delete r;
-	outFilter.clear();
+static std::string BlockPath(const std::vector<const Block *> & path) {
+	std::stringstream ss;
+	for (auto it = path.rbegin(); it != path.rend(); ++it) {
+		if (it != path.rbegin()) ss << " in ";
+		ss << (*it)->name();
+		if ((*it)->line > 0) ss << " at line " << (*it)->line;
+	}
+	return ss.str();
+}
+
+/*
+Aborts the compilation because the estimate is over a limit, or only gives a warning if asked to.
+*/
+static void OverLimit(Logger & log, const CompilerOptions & options, const std::string & message) {
+	if (options.warnRules) {
+		log.warning() << message << std::endl;
+	} else {
+		throw std::runtime_error(message);
+	}
+}
+
+/*
+Computes an upper bound on the number of native rules generated by a block, without compiling anything.
+Goes through the same steps as CompileBlock, assuming that no rule ever turns out to be useless:
+every rule is split by every rule of a modifier, and copied for every rule of a condition group.
+
+Blocks over the per-block limit are reported. Only the innermost ones are, their parents are over the limit because of them.
+Sets reported if this block or any of the nested blocks was reported.
+*/
+static RuleCount EstimateBlock(const Block * inBlock, std::vector<const Block *> & path,
+	Logger & log, const CompilerOptions & options, bool & reported) {
+
+	path.push_back(inBlock);
+	reported = false;
+
+	RuleCount total = 0;
+	RuleCount conditionGroups = 0;
+	bool hasConditionGroups = false;
+	bool hasCommands = false;
+	bool hasDefault = false;
+
+	for (const auto c : inBlock->commands) {
+		if (c->comType != COM_BLOCK) {
+			// Conditions and actions.
+			hasCommands = true;
+			continue;
+		}
+
+		const auto block = static_cast<const Block *>(c);
+		if (hasCommands) hasDefault = true;
+		hasCommands = false;
+
+		bool nestedReported = false;
+		RuleCount count = EstimateBlock(block, path, log, options, nestedReported);
+		if (nestedReported) reported = true;
+
+		switch (block->blockType) {
+			case BLOCK_RULE:
+			case BLOCK_GROUP:
+				total = AddCount(total, count);
+				break;
+
+			case BLOCK_CONDITIONGROUP:
+				conditionGroups = AddCount(conditionGroups, count);
+				hasConditionGroups = true;
+				break;
+
+			case BLOCK_MODIFIER:
+				if (total == 0) {
+					total = 1;
+					hasDefault = false;
+				}
+				// Every rule can be split by every rule of the modifier, and kept unless the modifier is Required.
+				total = MulCount(total, block->hasTag(TAG_REQUIRED) ? count : AddCount(count, 1));
+				break;
+
+			case BLOCK_DEFAULT:
+				total = AddCount(total, count);
+				hasDefault = false;
+				break;
+
+			default:
+				throw UnhandledCase("Block type", __FILE__, __LINE__);
+		}
+	}
+
+	if (hasCommands) hasDefault = true;
+	if (!inBlock->hasTag(TAG_NODEFAULT) && hasDefault) total = AddCount(total, 1);
+	if (hasConditionGroups) total = MulCount(total, conditionGroups);
+
+	if (!reported && options.maxBlockRules > 0 && total > options.maxBlockRules) {
+		std::stringstream ss;
+		ss << BlockPath(path) << " can generate up to " << CountString(total)
+			<< " native rules, over the limit of " << options.maxBlockRules << " per block.";
+		OverLimit(log, options, ss.str());
+		reported = true;
+	}
+
+	path.pop_back();
+	return total;
+}
+
+/*
+Checks the estimated number of native rules against the limits, before doing any expensive work.
+The estimate is added to the total of all blocks checked so far, the filter limit applies to that total.
+*/
+void Compiler::CheckLimits(const std::vector<const Block *> & blocks) {
+	if (options.maxRules == 0 && options.maxBlockRules == 0) return;
+
+	RuleCount largest = 0;
+	const Block * largestBlock = NULL;
+	std::vector<const Block *> path;
+
+	for (const auto block : blocks) {
+		bool reported = false;
+		RuleCount count = EstimateBlock(block, path, log, options, reported);
+		estimatedRules = AddCount(estimatedRules, count);
+		if (!largestBlock || count > largest) {
+			largest = count;
+			largestBlock = block;
+		}
+	}
+
+	if (largestBlock && options.maxRules > 0 && estimatedRules > options.maxRules) {
+		std::stringstream ss;
+		ss << "The filter can generate up to " << CountString(estimatedRules)
+			<< " native rules, over the limit of " << options.maxRules << ". "
+			<< "The largest block is " << BlockPath(std::vector<const Block *>(1, largestBlock))
+			<< " with up to " << CountString(largest) << " rules.";
+		OverLimit(log, options, ss.str());
+	}
+}
+
+std::vector<const Block *> TopLevelBlocks(const FilterIFPP & inFilter) {
+	std::vector<const Block *> blocks;
 
 	for (const auto ins : inFilter) {
 		switch (ins->insType) {
@@ -180,12 +856,9 @@ void Compiler::Compile(FilterNative & outFilter, const FilterIFPP & inFilter) {
 				const auto block = static_cast<Block *>(ins);
 				switch (block->blockType) {
 					case BLOCK_RULE:
-					case BLOCK_GROUP: {
-						FilterNative blockFilter;
-						CompileBlock(blockFilter, block);
-						AppendFilter(outFilter, blockFilter);
+					case BLOCK_GROUP:
+						blocks.push_back(block);
 						break;
-					}
 
 					default:
 						throw InternalError("Attempting to compile an invalid top-level block!", __FILE__, __LINE__);
@@ -197,6 +870,135 @@ void Compiler::Compile(FilterNative & outFilter, const FilterIFPP & inFilter) {
 				throw UnhandledCase("Instruction type", __FILE__, __LINE__);
 		}
 	}
+
+	return blocks;
+}
+
+/*
+True if the rules of a top-level block can be cropped by their modified copies (see ModifyRule).
+
+The old rule is cropped by what the copy matches within the old rule. A later modifier with an Override condition
+can replace a condition of the old rule, so that its copies match items outside of it, which the crop would then miss.
+So we only crop when there are no such conditions anywhere in the block. The whole block is checked,
+as its rules can be expanded before the modifiers of the enclosing blocks are applied.
+*/
+static bool CanCrop(const Block * block) {
+	for (const auto c : block->commands) {
+		switch (c->comType) {
+			case COM_CONDITION:
+				if (c->hasTag(TAG_OVERRIDE)) return false;
+				break;
+			case COM_BLOCK:
+				if (!CanCrop(static_cast<const Block *>(c))) return false;
+				break;
+			default:
+				break;
+		}
+	}
+	return true;
+}
+
+/*
+Compiles the top-level blocks, at most window of them at the same time.
+The rules of every block are passed to the sink in the order of the blocks, as soon as all previous blocks are done.
+Rules left in the filter after the sink returns are deleted.
+
+With a memory limit, rules which do not fit spill to files next to the output,
+and a block is passed to the sink in as many chunks as it takes to read it back.
+*/
+void Compiler::CompileBlocks(const std::vector<const Block *> & blocks, size_t window, const RuleSink & sink) {
+	estimatedRules = 0;
+	CheckLimits(blocks);
+	if (options.maxRules > 0 || options.maxBlockRules > 0) {
+		log.message() << "\tEstimated at most " << CountString(estimatedRules) << " native rules." << std::endl;
+	}
+
+	std::unique_ptr<SpillManager> spill;
+	if (options.memoryLimit > 0) spill.reset(new SpillManager(options.memoryLimit, options.spillBase));
+
+	if (window == 0) window = 1;
+	std::vector<RuleRun> blockRules;
+	for (size_t i = 0; i < std::min(window, blocks.size()); ++i) blockRules.emplace_back(spill.get());
+
+	CompileContext context(spill.get(), options, blocks.size());
+	const unsigned long long allocations = Arena<RuleNative>::allocations();
+	{
+		Scheduler scheduler(options.threads);
+
+		for (size_t start = 0; start < blocks.size(); start += window) {
+			size_t count = std::min(window, blocks.size() - start);
+
+			ParallelFor(scheduler, count, [&](size_t i) {
+				FilterProduct product(context, CanCrop(blocks[start + i]));
+				CompileBlock(product, blocks[start + i], scheduler, RulePtr(new RuleNative()));
+				product.expand(blockRules[i], scheduler, true);
+
+				++context.blocksDone;
+				context.report(true);
+			});
+
+			// Writing the rules can take a while too.
+			for (size_t i = 0; i < count; ++i) {
+				blockRules[i].consume([&context, &sink](FilterNative & chunk) {
+					context.check();
+					sink(chunk);
+				});
+			}
+		}
+	}
+
+	// The workers of the scheduler have finished, so their allocations are counted.
+	log.message() << "\tAllocated " << Arena<RuleNative>::allocations() - allocations << " rules for "
+		<< context.rulesGenerated << " native rules." << std::endl;
+	log.message() << "\tSkipped " << context.pairsRejected << " disjoint pairs of rules and modifiers." << std::endl;
+}
+
+/*
+Compiles an IFPP filter into a native filter.
+
+Every top-level block compiles independently of the others, so with more than one thread
+each of them is a separate task of the scheduler. The results are still appended in the order
+of the input, so the output does not depend on the number of threads.
+*/
+void Compiler::Compile(FilterNative & outFilter, const FilterIFPP & inFilter) {
+	for (const auto r : outFilter) delete r;
+	outFilter.clear();
+
+	auto blocks = TopLevelBlocks(inFilter);
+
+	// All blocks are compiled together, the output keeps all the rules anyway.
+	CompileBlocks(blocks, blocks.size(), [&outFilter](FilterNative & rules) {
+		AppendFilter(outFilter, rules);
+		rules.clear();
+	});
+}
+
+/*
+Streaming version of Compile: the rules of each top-level block are handed to the sink as soon as they are done,
+and freed afterwards. Only as many blocks as there are threads are compiled at the same time,
+so the memory needed depends on the largest blocks rather than the whole filter.
+*/
+void Compiler::Compile(const FilterIFPP & inFilter, const RuleSink & sink) {
+	CompileBlocks(TopLevelBlocks(inFilter), options.threads, sink);
+}
+
+/*
+Compiles a single top-level block, for callers which get the blocks one at a time.
+The limits are checked for this block and the total of all blocks compiled so far.
+*/
+void Compiler::Compile(FilterNative & outFilter, const Block * block, Scheduler & scheduler) {
+	CheckLimits(std::vector<const Block *>(1, block));
+
+	// Progress is left to the caller, they know how many blocks there are.
+	CompilerOptions blockOptions(options);
+	blockOptions.progress = NULL;
+	CompileContext context(NULL, blockOptions, 1);
+
+	FilterProduct product(context, CanCrop(block));
+	CompileBlock(product, block, scheduler, RulePtr(new RuleNative()));
+	RuleRun rules;
+	product.expand(rules, scheduler);
+	rules.release(outFilter);
 }
 
 }
\ No newline at end of file
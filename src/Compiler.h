@@ -5,15 +5,120 @@
 #include "RuleNative.h"
 #include "Logger.h"
 
+#include <atomic>
+#include <functional>
+#include <stdexcept>
+#include <string>
+
 namespace ifpp {
+
+class Scheduler;
+
+/*
+Lets another thread (or a signal handler) stop a compilation.
+The compiler checks the token regularly and throws CompileCancelled once it is cancelled.
+*/
+class CancelToken {
+public:
+	CancelToken() : flag(false) {}
+	CancelToken(const CancelToken &) = delete;
+	CancelToken & operator=(const CancelToken &) = delete;
+
+	void cancel() { flag = true; }
+	bool cancelled() const { return flag; }
+
+private:
+	std::atomic<bool> flag;
+};
+
+struct CompileCancelled : public std::runtime_error {
+	CompileCancelled() : std::runtime_error("Compilation cancelled.") {}
+};
+
+struct CompileProgress {
+	size_t blocksDone;
+	size_t blocksTotal;
+	double blocksWorked; // Blocks done, plus the expanded parts of the blocks being compiled.
+	unsigned long long rulesGenerated; // Including those of the blocks being compiled.
+	double secondsElapsed;
+	double secondsRemaining; // Negative if there is nothing to base an estimate on yet.
+};
+
+// Called after every top-level block, and now and then while compiling a large one.
+// Can be called from any of the compiling threads, but never from two at the same time.
+typedef std::function<void(const CompileProgress &)> ProgressCallback;
+
+struct CompilerOptions {
+	CompilerOptions() :
+		threads(1), maxRules(0), maxBlockRules(0), warnRules(false), memoryLimit(0), spillBase(), progress(), cancel(NULL),
+		removeDuplicates(false), removeShadowed(false), mergeRules(false) {}
+	// Copies share the cancel token.
+	CompilerOptions(const CompilerOptions &) = default;
+	CompilerOptions & operator=(const CompilerOptions &) = default;
+
+	// Number of threads compiling top-level blocks. 1 compiles everything in the calling thread.
+	int threads;
+
+	// Limits on the estimated number of native rules, for the whole filter and for any single block. 0 is no limit.
+	unsigned long long maxRules;
+	unsigned long long maxBlockRules;
+
+	// Only give a warning when a limit is exceeded, instead of aborting the compilation.
+	bool warnRules;
+
+	// Approximate memory in bytes for rules during the compilation, rules over the limit spill to files. 0 is no limit.
+	// Only useful with the streaming Compile, the other one keeps the entire output in memory anyway.
+	size_t memoryLimit;
+
+	// Spill files are named spillBase.spill<N>.
+	std::string spillBase;
+
+	// Progress is only reported by the Compile functions which get the whole filter.
+	ProgressCallback progress;
+
+	// Not owned by the options, must outlive the compilation.
+	const CancelToken * cancel;
+
+	// Remove rules with the same conditions as earlier rules from the output, see DuplicateIndex.
+	// Applied like removeShadowed, which also finds these, only slower.
+	bool removeDuplicates;
+
+	// Remove rules shadowed by earlier rules from the output, see ShadowIndex.
+	// Applied by whoever writes the rules, as the compiler only sees parts of the output.
+	bool removeShadowed;
+
+	// Merge consecutive rules which differ in a single name list or interval, see RuleMerger. Applied like removeShadowed.
+	bool mergeRules;
+};
 	
+// Receives the native rules of the top-level blocks, in order. A block can be passed in several chunks.
+// The sink can take the rules out of the filter, the rest is deleted.
+typedef std::function<void(FilterNative &)> RuleSink;
+	
+/*
+Collects the top-level blocks of a filter, which are compiled independently of each other.
+Anything else than a Rule or a Group at the top level is an internal error.
+*/
+std::vector<const Block *> TopLevelBlocks(const FilterIFPP & inFilter);
+
 class Compiler {
 public:
-	Compiler(Logger & l) : log(l) {};
+	Compiler(Logger & l, const CompilerOptions & o = CompilerOptions()) : log(l), options(o), estimatedRules(0) {};
 	void Compile(FilterNative & outFilter, const FilterIFPP & inFilter);
+	void Compile(const FilterIFPP & inFilter, const RuleSink & sink);
+	void Compile(FilterNative & outFilter, const Block * block, Scheduler & scheduler);
+
+	// Throws (or only warns, see CompilerOptions) if the blocks could generate more rules than the limits allow.
+	void CheckLimits(const std::vector<const Block *> & blocks);
 	
 private:
+	void CompileBlocks(const std::vector<const Block *> & blocks, size_t window, const RuleSink & sink);
+
 	Logger & log;
+	CompilerOptions options;
+
+	// Estimated number of native rules of all blocks checked against the limits so far.
+	unsigned long long estimatedRules;
 };
 
 }
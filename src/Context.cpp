@@ -86,7 +86,7 @@ void Context::defineVariable(const std::string & name, ExprType type, const std:
 	varFile[name] = value;
 }
 
-void Context::defineVariable(const std::string & name, ExprType type, const NameList & value) {
+void Context::defineVariable(const std::string & name, ExprType type, const SharedNames & value) {
 	if (type != EXPR_LIST) throw InternalError("Defining a variable with the wrong type! Expected EXPR_LIST.", __FILE__, __LINE__);
 	varList[name] = value;
 }
@@ -134,7 +134,7 @@ const std::string & Context::getVarValueFile(const std::string & name) const {
 	return varFile.at(name);
 }
 
-const NameList & Context::getVarValueList(const std::string & name) const {
+const SharedNames & Context::getVarValueList(const std::string & name) const {
 	return varList.at(name);
 }
 
@@ -148,7 +148,12 @@ void Context::addInstruction(Instruction * ins) {
 		case INS_BLOCK: ++countBlock; break;
 		default: ++countIns; break;
 	}
-	filter.push_back(ins);
+
+	if (blockSink && ins->insType == INS_BLOCK) {
+		blockSink(static_cast<Block *>(ins));
+	} else {
+		filter.push_back(ins);
+	}
 }
 
 std::ostream & Context::warningAt(const yy::location & l) {
@@ -4,6 +4,8 @@
 #include "Types.h"
 #include "Logger.h"
 
+#include <functional>
+
 namespace yy {
 	class location;
 }
@@ -14,7 +16,7 @@ class Context {
 public:
 	Context(const std::string & f, FilterIFPP & F, Logger & l) :
 		file(f), filter(F), countIns(0), countDef(0), countBlock(0), log(l),
-		varNumber(), varColor(), varFile(), varList(), varMacro() {};
+		varNumber(), varColor(), varFile(), varList(), varMacro(), blockSink() {};
 		
 	void reset();
 	void parse();
@@ -24,7 +26,7 @@ public:
 	void defineVariable(const std::string & name, ExprType type, int value);
 	void defineVariable(const std::string & name, ExprType type, const Color & value);
 	void defineVariable(const std::string & name, ExprType type, const std::string & value);
-	void defineVariable(const std::string & name, ExprType type, const NameList & value);
+	void defineVariable(const std::string & name, ExprType type, const SharedNames & value);
 	void defineVariable(const std::string & name, ExprType type, const CommandList & value);
 	
 	void undefineVariable(const std::string & name);
@@ -34,10 +36,14 @@ public:
 	int getVarValueNumber(const std::string & name) const;
 	const Color & getVarValueColor(const std::string & name) const;
 	const std::string & getVarValueFile(const std::string & name) const;
-	const NameList & getVarValueList(const std::string & name) const;
+	const SharedNames & getVarValueList(const std::string & name) const;
 	const CommandList & getVarValueMacro(const std::string & name) const;
 	
 	void addInstruction(Instruction * ins);
+
+	// Top-level blocks are passed to the sink as soon as they are parsed, instead of being added to the filter.
+	// The sink takes ownership of the blocks.
+	void setBlockSink(const std::function<void(Block *)> & sink) { blockSink = sink; }
 	
 	std::ostream & warningAt(const yy::location & l);
 	std::ostream & errorAt(const yy::location & l);
@@ -53,8 +59,10 @@ private:
 	std::map<std::string, int> varNumber;
 	std::map<std::string, Color> varColor;
 	std::map<std::string, std::string> varFile;
-	std::map<std::string, NameList> varList;
+	std::map<std::string, SharedNames> varList;
 	std::map<std::string, CommandList> varMacro;	
+
+	std::function<void(Block *)> blockSink;
 };
 
 }
@@ -0,0 +1,260 @@
+#include "Names.h"
+
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <queue>
+#include <unordered_map>
+
+namespace ifpp {
+
+static const unsigned NONE = ~0u;
+
+struct TrieNode {
+	TrieNode() : next(), fail(0), out(NONE), name(NONE) {}
+	std::map<char, unsigned> next;
+	unsigned fail; // Node of the longest proper suffix which is in the trie.
+	unsigned out; // Nearest node along fail links which ends a name.
+	unsigned name; // Name ending in this node.
+};
+
+typedef std::vector<TrieNode> Trie;
+
+// One bit per character (modulo 64) in the name. A name has all characters of the names it contains.
+static uint64_t Letters(const std::string & name) {
+	uint64_t bits = 0;
+	for (char c : name) bits |= uint64_t(1) << (c & 63);
+	return bits;
+}
+
+static void TrieInsert(Trie & trie, const std::string & name, unsigned n) {
+	unsigned node = 0;
+	for (char c : name) {
+		auto it = trie[node].next.find(c);
+		if (it == trie[node].next.end()) {
+			trie[node].next[c] = trie.size();
+			node = trie.size();
+			trie.push_back(TrieNode());
+		} else {
+			node = it->second;
+		}
+	}
+	trie[node].name = n;
+}
+
+/*
+An Aho-Corasick automaton of some names, which reports every one of them found in a string.
+*/
+class Automaton {
+public:
+	Automaton(const std::vector<const std::string *> & names, unsigned first, unsigned last) : trie(1) {
+		for (unsigned n = first; n < last; ++n) TrieInsert(trie, *names[n], n);
+
+		// Fail links, breadth first so that the links of shorter prefixes are known.
+		std::queue<unsigned> queue;
+		for (const auto & e : trie[0].next) queue.push(e.second);
+		while (!queue.empty()) {
+			unsigned node = queue.front();
+			queue.pop();
+			for (const auto & e : trie[node].next) {
+				unsigned child = e.second;
+				unsigned f = trie[node].fail;
+				if (node != 0) {
+					while (f != 0 && !trie[f].next.count(e.first)) f = trie[f].fail;
+					auto it = trie[f].next.find(e.first);
+					if (it != trie[f].next.end()) f = it->second;
+				}
+				trie[child].fail = f;
+				trie[child].out = trie[f].name != NONE ? f : trie[f].out;
+				queue.push(child);
+			}
+		}
+	}
+
+	// The names found in s, possibly more than once.
+	template<class F>
+	void find(const std::string & s, F found) const {
+		// The empty name is contained in every name.
+		if (trie[0].name != NONE) found(trie[0].name);
+
+		unsigned node = 0;
+		for (char c : s) {
+			auto it = trie[node].next.find(c);
+			while (node != 0 && it == trie[node].next.end()) {
+				node = trie[node].fail;
+				it = trie[node].next.find(c);
+			}
+			if (it != trie[node].next.end()) node = it->second;
+
+			for (unsigned m = trie[node].name != NONE ? node : trie[node].out; m != NONE && m != 0; m = trie[m].out) {
+				found(trie[m].name);
+			}
+		}
+	}
+
+private:
+	Trie trie;
+};
+
+/*
+All names of all lists, numbered in the order they were first seen. Names are never removed.
+*/
+class NameTable {
+public:
+	static NameTable & instance() {
+		static NameTable table;
+		return table;
+	}
+
+	std::mutex mutex;
+
+	// The number of a name, adding it if needed.
+	unsigned intern(const std::string & name) {
+		auto it = numbers.find(name);
+		if (it != numbers.end()) return it->second;
+
+		unsigned n = names.size();
+		names.push_back(&numbers.insert(std::make_pair(name, n)).first->first);
+		letters.push_back(Letters(name));
+		return n;
+	}
+
+	// Number of names so far. Relations below are complete for all of them after update.
+	size_t size() const { return names.size(); }
+	void update();
+
+	// Names contained in each name and names containing it, in increasing order. Both include the name itself.
+	std::vector<std::vector<unsigned>> contains;
+	std::vector<std::vector<unsigned>> containedIn;
+
+private:
+	NameTable() : mutex(), contains(), containedIn(), numbers(), names(), letters(), trie(1) {}
+	NameTable(const NameTable &) = delete;
+	NameTable & operator=(const NameTable &) = delete;
+
+	std::unordered_map<std::string, unsigned> numbers;
+	std::vector<const std::string *> names; // Keys of numbers, which stay put.
+	std::vector<uint64_t> letters; // See Letters.
+
+	// Trie of the names with relations so far.
+	Trie trie;
+};
+
+/*
+Finds which names contain which, for the names added since last time.
+The relations between older names do not change, so only pairs with at least one new name are looked at:
+the new names are looked up in the trie of all names from every position of each new name,
+and an Aho-Corasick automaton of only the new names is run over the older names.
+Older names without all characters of any new name are skipped, unless that takes longer than the automaton.
+New names have higher numbers than all older ones, so appending them keeps the relations in order.
+This matters with --pipeline, where names are still added by the parser while the compiler compares lists.
+*/
+void NameTable::update() {
+	const unsigned old = contains.size();
+	if (old == names.size()) return;
+
+	contains.resize(names.size());
+	containedIn.resize(names.size());
+	for (unsigned n = old; n < names.size(); ++n) TrieInsert(trie, *names[n], n);
+
+	// Older names containing new ones.
+	const Automaton added(names, old, names.size());
+	const bool filter = names.size() - old <= 64;
+	std::vector<unsigned> found;
+	for (unsigned n = 0; n < old; ++n) {
+		if (filter) {
+			bool any = false;
+			for (unsigned m = old; m < names.size() && !any; ++m) any = !(letters[m] & ~letters[n]);
+			if (!any) continue;
+		}
+
+		found.clear();
+		added.find(*names[n], [&found](unsigned m) { found.push_back(m); });
+		std::sort(found.begin(), found.end());
+		found.erase(std::unique(found.begin(), found.end()), found.end());
+		for (auto m : found) {
+			contains[n].push_back(m);
+			containedIn[m].push_back(n);
+		}
+	}
+
+	// All names contained in new ones, those starting at each position of the new name in turn.
+	for (unsigned n = old; n < names.size(); ++n) {
+		const std::string & name = *names[n];
+		found.clear();
+		if (trie[0].name != NONE) found.push_back(trie[0].name);
+		for (size_t i = 0; i < name.size(); ++i) {
+			unsigned node = 0;
+			for (size_t j = i; j < name.size(); ++j) {
+				auto it = trie[node].next.find(name[j]);
+				if (it == trie[node].next.end()) break;
+				node = it->second;
+				if (trie[node].name != NONE) found.push_back(trie[node].name);
+			}
+		}
+		std::sort(found.begin(), found.end());
+		found.erase(std::unique(found.begin(), found.end()), found.end());
+		contains[n] = found;
+		for (auto m : found) containedIn[m].push_back(n);
+	}
+}
+
+NameSet::NameSet(const NameList & nl) :
+	list(nl), ids(), letters(~uint64_t(0)), indexed(false), known(0), members(), matched(), containedFirst(), contained() {
+
+	NameTable & table = NameTable::instance();
+	std::lock_guard<std::mutex> lock(table.mutex);
+	ids.reserve(list.size());
+	for (const auto & name : list) ids.push_back(table.intern(name));
+
+	for (const auto & name : list) letters &= Letters(name);
+}
+
+void NameSet::buildIndex() const {
+	NameTable & table = NameTable::instance();
+	std::lock_guard<std::mutex> lock(table.mutex);
+	if (indexed) return; // Another thread was faster.
+	table.update();
+
+	known = table.size();
+	members.assign((known + 63) / 64, 0);
+	matched.assign((known + 63) / 64, 0);
+	for (auto n : ids) {
+		members[n / 64] |= uint64_t(1) << n % 64;
+		for (auto m : table.containedIn[n]) matched[m / 64] |= uint64_t(1) << m % 64;
+	}
+
+	for (auto n : ids) {
+		containedFirst.push_back(contained.size());
+		contained.insert(contained.end(), table.contains[n].begin(), table.contains[n].end());
+	}
+	containedFirst.push_back(contained.size());
+	indexed.store(true, std::memory_order_release);
+}
+
+/*
+The other list was indexed either before a name of this list was added, or after.
+In the first case, the name is compared by the names the other list contains; in the second, by the names the other list matches.
+*/
+bool NameSet::subsetOf(const NameSet & other) const {
+	if (other.letters & ~letters) return false;
+
+	index();
+	other.index();
+
+	for (size_t i = 0; i < ids.size(); ++i) {
+		if (ids[i] < other.known) {
+			if (!test(other.matched, ids[i])) return false;
+			continue;
+		}
+
+		bool found = false;
+		for (unsigned j = containedFirst[i]; j < containedFirst[i + 1] && !found; ++j) {
+			found = test(other.members, contained[j]);
+		}
+		if (!found) return false;
+	}
+	return true;
+}
+
+}
@@ -0,0 +1,63 @@
+#ifndef IFPP_NAMES_H
+#define IFPP_NAMES_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace ifpp {
+
+typedef std::vector<std::string> NameList;
+
+/*
+The names of a name list condition, indexed so that lists can be compared quickly.
+
+A name matches every item whose name contains it, so a list matches everything another one does
+if every name of the other list contains some name of this one. Every distinct name gets a number in a table
+shared by all lists, and which names contain which is kept for all names of the table. It is brought up to date
+the first time some list is compared after new names were added, looking only at pairs with a new name,
+so with --pipeline new blocks do not cost a pass over all pairs again.
+
+Each list then keeps, as bits over the numbers of names, its own names and the names it matches.
+The latter only covers the names known when the list was first compared; for names added later,
+the list compared to it keeps the names contained in each of its own names instead.
+*/
+class NameSet {
+public:
+	explicit NameSet(const NameList & nl);
+	NameSet(const NameSet &) = delete;
+	NameSet & operator=(const NameSet &) = delete;
+
+	const NameList & names() const { return list; }
+	bool operator==(const NameList & nl) const { return list == nl; }
+
+	// True if every name of this list contains some name of the other one.
+	bool subsetOf(const NameSet & other) const;
+
+private:
+	typedef std::vector<uint64_t> Bits;
+	static bool test(const Bits & bits, unsigned i) { return i < 64 * bits.size() && bits[i / 64] >> i % 64 & 1; }
+
+	void buildIndex() const;
+	void index() const { if (!indexed.load(std::memory_order_acquire)) buildIndex(); }
+
+	const NameList list;
+	std::vector<unsigned> ids; // Numbers of the names, in order.
+
+	// One bit per character (modulo 64) which is in all names. A name has all characters of the names it contains,
+	// so a list can only match everything another one does if all of its bits are in the other one.
+	uint64_t letters;
+
+	// Built on first use.
+	mutable std::atomic<bool> indexed;
+	mutable unsigned known; // Names with lower numbers are in matched.
+	mutable Bits members;
+	mutable Bits matched;
+	mutable std::vector<unsigned> containedFirst; // The names contained in names[i] are contained[containedFirst[i]] up to containedFirst[i + 1].
+	mutable std::vector<unsigned> contained;
+};
+
+}
+
+#endif
@@ -0,0 +1,319 @@
+#include "Optimizer.h"
+
+#include <algorithm>
+#include <functional>
+
+namespace ifpp {
+
+/***********
+* DUPLICATE RULES
+***********/
+
+size_t DuplicateIndex::KeyHash::operator()(const Key & key) const {
+	size_t h = key.size();
+	for (const int x : key) h ^= std::hash<int>()(x) + 0x9e3779b9 + (h << 6) + (h >> 2);
+	return h;
+}
+
+// The number of the canonical form of a name list, worked out once for every list.
+unsigned DuplicateIndex::listId(const SharedNames & names) {
+	auto it = listIds.find(&*names);
+	if (it != listIds.end()) return it->second.second;
+
+	// A name containing another name of the list matches nothing more. Of equal names, the first one is kept.
+	const NameList & all = names->names();
+	NameList nl;
+	for (size_t i = 0; i < all.size(); ++i) {
+		bool redundant = false;
+		for (size_t j = 0; j < all.size() && !redundant; ++j) {
+			if (j != i && all[i].find(all[j]) != std::string::npos && (all[i] != all[j] || j < i)) redundant = true;
+		}
+		if (!redundant) nl.push_back(all[i]);
+	}
+	std::sort(nl.begin(), nl.end());
+
+	const unsigned id = lists.insert(std::make_pair(nl, static_cast<unsigned>(lists.size()))).first->second;
+	listIds.insert(std::make_pair(&*names, std::make_pair(names, id)));
+	return id;
+}
+
+/*
+The conditions of the rule, in the order of their kinds: the kind, then the values for intervals and bools,
+or the number of conditions and their sorted canonical lists (or packed socket groups) for lists.
+*/
+DuplicateIndex::Key DuplicateIndex::canonical(const RuleNative * rule) {
+	Key key;
+	for (int k = 0; k < CK_COUNT; ++k) {
+		const ConditionKind kind = static_cast<ConditionKind>(k);
+		if (!rule->hasCondition(kind)) continue;
+
+		switch (ConditionKindType(kind)) {
+			case CON_INTERVAL: {
+				const auto & limits = ConditionLimits(kind);
+				const int from = std::max(rule->conditions[k].from, limits.first);
+				const int to = std::min(rule->conditions[k].to, limits.second);
+				if (from == limits.first && to == limits.second) break;
+				key.push_back(k);
+				key.push_back(from);
+				key.push_back(to);
+				break;
+			}
+			case CON_BOOL:
+				key.push_back(k);
+				key.push_back(rule->conditions[k].from ? 1 : 0);
+				break;
+			case CON_NAMELIST:
+			case CON_SOCKETGROUP: {
+				// All conditions of a kind must match, in any order, and the same one twice is the same as once.
+				std::vector<int> ids;
+				for (const auto & c : rule->lists) {
+					if (c.kind != kind) continue;
+					ids.push_back(kind == CK_SOCKETGROUP ? static_cast<int>(c.sockets) : static_cast<int>(listId(c.names)));
+				}
+				std::sort(ids.begin(), ids.end());
+				ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+				key.push_back(k);
+				key.push_back(ids.size());
+				key.insert(key.end(), ids.begin(), ids.end());
+				break;
+			}
+			default:
+				throw UnhandledCase("Condition type", __FILE__, __LINE__);
+		}
+	}
+	return key;
+}
+
+void DuplicateIndex::filter(FilterNative & rules) {
+	size_t numKept = 0;
+	for (const auto r : rules) {
+		if (seen.insert(canonical(r)).second) {
+			rules[numKept++] = r;
+		} else {
+			delete r;
+			++numRemoved;
+		}
+	}
+	rules.resize(numKept);
+}
+
+/***********
+* SHADOWED RULES
+***********/
+
+ShadowIndex::Bucket::Bucket(unsigned mask) : kinds(), rules(), levels(), capacity(0) {
+	for (int k = 0; k < CK_COUNT; ++k) {
+		if (mask & 1u << k && ConditionKindType(static_cast<ConditionKind>(k)) == CON_INTERVAL) kinds.push_back(k);
+	}
+}
+
+void ShadowIndex::Bucket::add(const RuleNative * rule) {
+	const size_t n = rules.size();
+	rules.push_back(rule);
+	if (kinds.empty()) return;
+
+	// The last box is full, it becomes the first box of a new level.
+	if (n == capacity) {
+		const size_t width = 2 * kinds.size();
+		levels.push_back(levels.empty() ? std::vector<int>() : std::vector<int>(levels.back().begin(), levels.back().begin() + width));
+		capacity = capacity ? capacity * FANOUT : FANOUT;
+	}
+
+	// Widen the boxes holding the rule, or start new ones.
+	size_t i = n;
+	for (auto & boxes : levels) {
+		i /= FANOUT;
+		if (i * 2 * kinds.size() == boxes.size()) {
+			for (auto k : kinds) {
+				boxes.push_back(rule->conditions[k].from);
+				boxes.push_back(rule->conditions[k].to);
+			}
+		} else {
+			int * box = &boxes[i * 2 * kinds.size()];
+			for (size_t d = 0; d < kinds.size(); ++d) {
+				box[2 * d] = std::min(box[2 * d], rule->conditions[kinds[d]].from);
+				box[2 * d + 1] = std::max(box[2 * d + 1], rule->conditions[kinds[d]].to);
+			}
+		}
+	}
+}
+
+// True if every interval of the box contains the interval of the same kind of the rule.
+bool ShadowIndex::Bucket::contains(const std::vector<int> & boxes, size_t i, const RuleNative * rule) const {
+	const int * box = &boxes[i * 2 * kinds.size()];
+	for (size_t d = 0; d < kinds.size(); ++d) {
+		const ConditionSlot & slot = rule->conditions[kinds[d]];
+		if (box[2 * d] > slot.from || box[2 * d + 1] < slot.to) return false;
+	}
+	return true;
+}
+
+bool ShadowIndex::Bucket::shadows(size_t level, size_t i, const RuleNative * rule) const {
+	if (!contains(levels[level], i, rule)) return false;
+
+	if (level == 0) {
+		for (size_t j = i * FANOUT; j < rules.size() && j < (i + 1) * FANOUT; ++j) {
+			if (RuleSubset(rule, rules[j])) return true;
+		}
+	} else {
+		const size_t boxes = levels[level - 1].size() / (2 * kinds.size());
+		for (size_t j = i * FANOUT; j < boxes && j < (i + 1) * FANOUT; ++j) {
+			if (shadows(level - 1, j, rule)) return true;
+		}
+	}
+	return false;
+}
+
+bool ShadowIndex::Bucket::shadows(const RuleNative * rule) const {
+	if (rules.empty()) return false;
+
+	if (kinds.empty()) {
+		for (const auto r : rules) {
+			if (RuleSubset(rule, r)) return true;
+		}
+		return false;
+	}
+	return shadows(levels.size() - 1, 0, rule);
+}
+
+bool ShadowIndex::shadowed(const RuleNative * rule) const {
+	for (const auto mask : masks) {
+		if (mask & ~rule->conditionMask) continue;
+
+		auto it = buckets.find(std::make_pair(mask, rule->trueMask & mask));
+		if (it != buckets.end() && it->second.shadows(rule)) return true;
+	}
+	return false;
+}
+
+void ShadowIndex::add(const RuleNative * rule) {
+	kept.push_back(RulePtr(rule->clone()));
+	const RuleNative * r = kept.back().get();
+
+	auto key = std::make_pair(r->conditionMask, r->trueMask);
+	auto it = buckets.find(key);
+	if (it == buckets.end()) {
+		if (std::find(masks.begin(), masks.end(), key.first) == masks.end()) masks.push_back(key.first);
+		it = buckets.insert(std::make_pair(key, Bucket(key.first))).first;
+	}
+	it->second.add(r);
+}
+
+void ShadowIndex::filter(FilterNative & rules) {
+	size_t numKept = 0;
+	for (const auto r : rules) {
+		if (shadowed(r)) {
+			delete r;
+			++numRemoved;
+		} else {
+			add(r);
+			rules[numKept++] = r;
+		}
+	}
+	rules.resize(numKept);
+}
+
+/***********
+* MERGED RULES
+***********/
+
+// True if both rules print the same actions. Removed actions are not printed, whatever their values.
+static bool SamePrintedActions(const RuleNative * a, const RuleNative * b) {
+	for (int k = 0; k < AK_COUNT; ++k) {
+		const bool shownA = a->hasAction(static_cast<ActionKind>(k)) && !(a->actions[k].tags & TAG_REMOVE);
+		const bool shownB = b->hasAction(static_cast<ActionKind>(k)) && !(b->actions[k].tags & TAG_REMOVE);
+		if (shownA != shownB) return false;
+		if (shownA && (a->actions[k].value != b->actions[k].value || a->actions[k].text != b->actions[k].text)) return false;
+	}
+	return true;
+}
+
+// Merges the rule into the last one, if they differ in at most one condition which can be merged.
+bool RuleMerger::merge(const RuleNative * rule) {
+	RuleNative * l = last.get();
+	if (l->conditionMask != rule->conditionMask || l->lists.size() != rule->lists.size() || !SamePrintedActions(l, rule)) return false;
+
+	int interval = -1;
+	for (int k = 0; k < CK_COUNT; ++k) {
+		if (!l->hasCondition(static_cast<ConditionKind>(k))) continue;
+		const ConditionType type = ConditionKindType(static_cast<ConditionKind>(k));
+		if (type != CON_INTERVAL && type != CON_BOOL) continue;
+		if (l->conditions[k].from == rule->conditions[k].from && l->conditions[k].to == rule->conditions[k].to) continue;
+		if (type != CON_INTERVAL || interval >= 0) return false;
+		interval = k;
+	}
+
+	int list = -1;
+	for (size_t i = 0; i < l->lists.size(); ++i) {
+		const ListCondition & a = l->lists[i];
+		const ListCondition & b = rule->lists[i];
+		if (a.kind != b.kind || a.sockets != b.sockets) return false;
+		if (a.names == b.names) continue;
+		if (ConditionKindType(a.kind) != CON_NAMELIST || list >= 0 || interval >= 0) return false;
+		list = i;
+	}
+
+	if (interval >= 0) {
+		const ConditionSlot & a = l->conditions[interval];
+		const ConditionSlot & b = rule->conditions[interval];
+		// Bounds are inclusive, so [1, 2] and [3, 4] touch.
+		if (static_cast<long long>(b.from) > static_cast<long long>(a.to) + 1) return false;
+		if (static_cast<long long>(a.from) > static_cast<long long>(b.to) + 1) return false;
+		l->setValue(static_cast<ConditionKind>(interval), ConditionSlot{std::min(a.from, b.from), std::max(a.to, b.to), a.tags});
+	} else if (list >= 0) {
+		NameList names = l->lists[list].names->names();
+		for (const auto & name : rule->lists[list].names->names()) {
+			if (std::find(names.begin(), names.end(), name) == names.end()) names.push_back(name);
+		}
+		l->lists[list].names = SharedNames(names);
+	}
+	return true;
+}
+
+void RuleMerger::filter(FilterNative & rules) {
+	// At most one rule is written for every rule read, so nothing is overwritten before it is read.
+	size_t numKept = 0;
+	for (const auto r : rules) {
+		if (last && merge(r)) {
+			delete r;
+			++numMerged;
+			continue;
+		}
+		if (last) rules[numKept++] = last.release();
+		last.reset(r);
+	}
+	rules.resize(numKept);
+}
+
+void RuleMerger::finish(FilterNative & rules) {
+	if (last) rules.push_back(last.release());
+}
+
+/***********
+* OUTPUT
+***********/
+
+OutputOptimizer::OutputOptimizer(const CompilerOptions & options) :
+	duplicates(options.removeDuplicates ? new DuplicateIndex() : NULL),
+	shadow(options.removeShadowed ? new ShadowIndex() : NULL),
+	merger(options.mergeRules ? new RuleMerger() : NULL) {}
+
+// Duplicates are cheap to find, and leave fewer rules to compare for shadowing.
+// Shadowed rules are removed before merging, so that the rules around them can be merged.
+void OutputOptimizer::filter(FilterNative & rules) {
+	if (duplicates) duplicates->filter(rules);
+	if (shadow) shadow->filter(rules);
+	if (merger) merger->filter(rules);
+}
+
+void OutputOptimizer::finish(FilterNative & rules) {
+	if (merger) merger->finish(rules);
+}
+
+void OutputOptimizer::report(Logger & log) const {
+	if (duplicates) log.message() << "\tRemoved " << duplicates->removed() << " rules with the same conditions as earlier rules." << std::endl;
+	if (shadow) log.message() << "\tRemoved " << shadow->removed() << " rules shadowed by earlier rules." << std::endl;
+	if (merger) log.message() << "\tMerged " << merger->merged() << " rules into the rules before them." << std::endl;
+}
+
+}
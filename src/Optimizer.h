@@ -0,0 +1,169 @@
+#ifndef IFPP_OPTIMIZER_H
+#define IFPP_OPTIMIZER_H
+
+#include "Types.h"
+#include "RuleNative.h"
+#include "Logger.h"
+#include "Compiler.h"
+
+#include <map>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+namespace ifpp {
+
+/*
+Removes rules with the same conditions as an earlier rule, which never match an item: the earlier rule always wins.
+Rules are compared by a canonical form of their conditions, so that rules printed differently but matching the same
+items are found as well: intervals are clamped to the values allowed for their kind, conditions which allow
+all of them are left out, and name lists are sorted, without repeated names or names containing another name of the list.
+
+The rules are passed through in the order they are written, in as many chunks as needed.
+Only the canonical forms of the rules are kept, in a hash set, so every rule takes expected constant time.
+This finds a subset of what ShadowIndex does, much faster.
+*/
+class DuplicateIndex {
+public:
+	DuplicateIndex() : lists(), listIds(), seen(), numRemoved(0) {}
+	DuplicateIndex(const DuplicateIndex &) = delete;
+	DuplicateIndex & operator=(const DuplicateIndex &) = delete;
+
+	// Deletes the duplicate rules of the chunk, keeping the order of the others.
+	void filter(FilterNative & rules);
+
+	unsigned long long removed() const { return numRemoved; }
+
+private:
+	typedef std::vector<int> Key;
+	struct KeyHash {
+		size_t operator()(const Key & key) const;
+	};
+
+	unsigned listId(const SharedNames & names);
+	Key canonical(const RuleNative * rule);
+
+	// Numbers of the canonical name lists, and of the lists seen so far. Holding the lists keeps them from being reused.
+	std::map<NameList, unsigned> lists;
+	std::unordered_map<const NameSet *, std::pair<SharedNames, unsigned> > listIds;
+
+	std::unordered_set<Key, KeyHash> seen;
+	unsigned long long numRemoved;
+};
+
+/*
+Removes rules which never match an item, because an earlier rule matches everything they do
+(RuleSubset(later, earlier)) and the first matching rule wins. Works across blocks, unlike the compiler.
+
+The rules are passed through in the order they are written, in as many chunks as needed.
+The index keeps a copy of every rule it lets through, since the rules themselves may be deleted once written.
+
+Rules which can shadow a rule must have a subset of its kinds of conditions and the same bool values,
+so the copies are grouped by those. Within a group, their interval conditions are indexed by a tree of boxes
+(an R-tree, packed in the order the rules come in): every box holds the lowest lower bound and the highest upper bound
+of every interval condition of some consecutive rules, or boxes. Only rules in boxes which contain all intervals
+of a rule are compared to it. Rules come out of the compiler ordered by their conditions, so the boxes are tight.
+*/
+class ShadowIndex {
+public:
+	ShadowIndex() : kept(), masks(), buckets(), numRemoved(0) {}
+	ShadowIndex(const ShadowIndex &) = delete;
+	ShadowIndex & operator=(const ShadowIndex &) = delete;
+
+	// Deletes the shadowed rules of the chunk, keeping the order of the others.
+	void filter(FilterNative & rules);
+
+	unsigned long long removed() const { return numRemoved; }
+
+private:
+	struct Bucket {
+		explicit Bucket(unsigned mask);
+
+		void add(const RuleNative * rule);
+		bool shadows(const RuleNative * rule) const;
+
+	private:
+		bool contains(const std::vector<int> & boxes, size_t i, const RuleNative * rule) const;
+		bool shadows(size_t level, size_t i, const RuleNative * rule) const;
+
+		std::vector<int> kinds; // Of the interval conditions of the rules.
+		std::vector<const RuleNative *> rules;
+
+		// levels[0] holds the boxes of FANOUT rules each, levels[l] the boxes of FANOUT boxes of levels[l - 1] each.
+		// A box is the lowest lower bound and the highest upper bound for each of kinds. The last level has one box,
+		// for up to capacity rules.
+		std::vector<std::vector<int> > levels;
+		size_t capacity;
+	};
+
+	// Rules or boxes per box.
+	static const size_t FANOUT = 16;
+
+	bool shadowed(const RuleNative * rule) const;
+	void add(const RuleNative * rule);
+
+	std::vector<RulePtr> kept;
+	std::vector<unsigned> masks; // Distinct condition masks of the buckets.
+	std::map<std::pair<unsigned, unsigned>, Bucket> buckets; // By condition mask and bool values.
+	unsigned long long numRemoved;
+};
+
+/*
+Merges runs of consecutive rules which only differ in one name list condition, or in one interval condition
+where the intervals overlap or touch, and print the same actions. The merged rule has the union of the names,
+or the smallest interval containing both. An item matched by either rule is matched by the merged one,
+and would have got the same actions before. Nothing can come between the rules, so this is always safe.
+
+The rules are passed through in the order they are written, in as many chunks as needed.
+The last rule of every chunk is held back, since it can be merged with the first rule of the next one.
+*/
+class RuleMerger {
+public:
+	RuleMerger() : last(), numMerged(0) {}
+	RuleMerger(const RuleMerger &) = delete;
+	RuleMerger & operator=(const RuleMerger &) = delete;
+
+	// Merges the rules of the chunk, deleting the rules merged into earlier ones.
+	void filter(FilterNative & rules);
+
+	// Adds the rule held back, after the last chunk.
+	void finish(FilterNative & rules);
+
+	unsigned long long merged() const { return numMerged; }
+
+private:
+	bool merge(const RuleNative * rule);
+
+	RulePtr last;
+	unsigned long long numMerged;
+};
+
+/*
+The optimizations of the output asked for in the options, in the order they are applied.
+*/
+class OutputOptimizer {
+public:
+	explicit OutputOptimizer(const CompilerOptions & options);
+	OutputOptimizer(const OutputOptimizer &) = delete;
+	OutputOptimizer & operator=(const OutputOptimizer &) = delete;
+
+	// Optimizes a chunk of rules in place. Some rules may only come out of the next call, or of finish.
+	void filter(FilterNative & rules);
+
+	// Adds the rules still held back, after the last chunk.
+	void finish(FilterNative & rules);
+
+	// Logs what was done.
+	void report(Logger & log) const;
+
+private:
+	std::unique_ptr<DuplicateIndex> duplicates;
+	std::unique_ptr<ShadowIndex> shadow;
+	std::unique_ptr<RuleMerger> merger;
+};
+
+}
+
+#endif
@@ -15,6 +15,47 @@
 
 	#include "Types.h"
 	#include "Context.h"
+
+	/*
+	A name list being parsed. As long as it is a single list variable, it shares the list of the variable,
+	the names are only copied once something is added to it.
+	*/
+	struct NameListExpr {
+		NameListExpr() : names(), shared() {}
+
+		void add(const std::string & name) {
+			unshare();
+			names.push_back(name);
+		}
+
+		void add(const ifpp::SharedNames & list) {
+			if (names.empty() && shared.empty()) {
+				shared = list;
+			} else {
+				unshare();
+				names.insert(names.end(), list->names().begin(), list->names().end());
+			}
+		}
+
+		ifpp::SharedNames result() const {
+			return shared.empty() ? ifpp::SharedNames(names) : shared;
+		}
+
+		std::ostream & printSelf(std::ostream & os) const {
+			return ifpp::operator<<(os, shared.empty() ? names : shared->names());
+		}
+
+	private:
+		void unshare() {
+			if (!shared.empty()) {
+				names = shared->names();
+				shared = ifpp::SharedNames();
+			}
+		}
+
+		ifpp::NameList names;
+		ifpp::SharedNames shared;
+	};
 }
 
 %param { ifpp::Context & ctx }
@@ -106,14 +147,15 @@
 	}
 
 	static ifpp::ConditionInterval * magicInterval(ifpp::Context & ctx, const yy::location & l,
-		const std::string & what, int from, int to, ifpp::TagList tags) {
+		ifpp::ConditionKind what, int from, int to, ifpp::TagList tags) {
 
-		clampInterval(ctx, l, what, from, to, ifpp::getLimit(what, ifpp::MIN), ifpp::getLimit(what, ifpp::MAX));
+		const std::string & name = ifpp::ConditionName(what);
+		clampInterval(ctx, l, name, from, to, ifpp::getLimit(name, ifpp::MIN), ifpp::getLimit(name, ifpp::MAX));
 		return new ifpp::ConditionInterval(what, from, to, tags);
 	}
 
 	static ifpp::ConditionInterval * magicInterval(ifpp::Context & ctx, const yy::location & l,
-		const std::string & what, ifpp::Operator op, int value, ifpp::TagList tags) {
+		ifpp::ConditionKind what, ifpp::Operator op, int value, ifpp::TagList tags) {
 
 		int from = INT_MIN, to = INT_MAX;
 		switch(op) {
@@ -178,19 +220,6 @@
 	KW_GROUP "Group"	
 	KW_DEFAULT "Default"
 	
-	CON_NUMBER "Condition (Number)"
-	CON_RARITY "Condition (Rarity)"
-	CON_LIST "Condition (List)"
-	CON_BOOL "Condition (Boolean)"
-	CON_SOCKETGROUP "Condition (Socket group)"
-	
-	AC_NUMBER "Action (Number)"
-	AC_COLOR "Action (Color)"
-	AC_SOUND "Action (Sound)"
-	AC_BOOL "Action (Boolean)"
-	AC_CUSTOMSOUND "Action (Custom sound)"
-	AC_MINIMAPICON "Action (Minimap icon)"
-	AC_PLAYEFFECT "Action (Play effect)"
 	AC_REMOVE "Action (Remove)"
 
 	AC_USEMACRO "Action (Use macro)"
@@ -207,6 +236,24 @@
 	NAME "name"
 ;
 
+%token <ifpp::ConditionKind>
+	CON_NUMBER "Condition (Number)"
+	CON_RARITY "Condition (Rarity)"
+	CON_LIST "Condition (List)"
+	CON_BOOL "Condition (Boolean)"
+	CON_SOCKETGROUP "Condition (Socket group)"
+;
+
+%token <ifpp::ActionKind>
+	AC_NUMBER "Action (Number)"
+	AC_COLOR "Action (Color)"
+	AC_SOUND "Action (Sound)"
+	AC_BOOL "Action (Boolean)"
+	AC_CUSTOMSOUND "Action (Custom sound)"
+	AC_MINIMAPICON "Action (Minimap icon)"
+	AC_PLAYEFFECT "Action (Play effect)"
+;
+
 %token <int>
 	NUMBER "number"
 	CONST_RARITY "rarity"
@@ -254,12 +301,13 @@
 
 %type <ifpp::TagList> tags
 
-%type <ifpp::NameList> exprList
+%type <NameListExpr> exprList
 
 %type <ifpp::Color>	exprColor
 
+%type <ifpp::ActionKind> actionName
+
 %type <std::string>
-	actionName
 	soundId
 	exprFile
 ;
@@ -276,7 +324,7 @@
 	<ifpp::Action *>
 	<ifpp::Block *>
 	<ifpp::CommandList>
-	<ifpp::NameList>
+	<NameListExpr>
 	<ifpp::TagList>
 ;
 
@@ -306,33 +354,33 @@ definition:
 | KW_DEFINE VARIABLE[name] TYPE_FILE[type] exprFile[value] NEWLINE
 	{ $$ = magicDefinition(ctx, @$, $name, $type, $value); }
 | KW_DEFINE VARIABLE[name] TYPE_LIST[type] exprList[value] NEWLINE
-	{ $$ = magicDefinition(ctx, @$, $name, $type, $value); }
+	{ $$ = magicDefinition(ctx, @$, $name, $type, $value.result()); }
 | KW_DEFINE VARIABLE[name] TYPE_MACRO[type] newlines CHR_LEFTBRACKET NEWLINE commandsAny[value] CHR_RIGHTBRACKET NEWLINE
 	{ $$ = magicDefinition(ctx, @$, $name, $type, $value); }
 
 rule:
 tags KW_RULE[what] newlines CHR_LEFTBRACKET NEWLINE commandsAny CHR_RIGHTBRACKET NEWLINE {
-	$$ = new ifpp::Block(ifpp::BLOCK_RULE, $what, $commandsAny, $tags);
+	$$ = new ifpp::Block(ifpp::BLOCK_RULE, $commandsAny, $tags, @what.begin.line);
 }
 
 conditionGroup:
 tags KW_CONDITIONGROUP[what] newlines CHR_LEFTBRACKET NEWLINE commandsConditions CHR_RIGHTBRACKET NEWLINE {
-	$$ = new ifpp::Block(ifpp::BLOCK_CONDITIONGROUP, $what, $commandsConditions, $tags);
+	$$ = new ifpp::Block(ifpp::BLOCK_CONDITIONGROUP, $commandsConditions, $tags, @what.begin.line);
 }
 
 modifier:
 tags KW_MODIFIER[what] newlines CHR_LEFTBRACKET NEWLINE commandsAny CHR_RIGHTBRACKET NEWLINE {
-	$$ = new ifpp::Block(ifpp::BLOCK_MODIFIER, $what, $commandsAny, $tags);
+	$$ = new ifpp::Block(ifpp::BLOCK_MODIFIER, $commandsAny, $tags, @what.begin.line);
 }
 
 group:
 tags KW_GROUP[what] newlines CHR_LEFTBRACKET NEWLINE commandsGroup CHR_RIGHTBRACKET NEWLINE {
-	$$ = new ifpp::Block(ifpp::BLOCK_GROUP, $what, $commandsGroup, $tags);
+	$$ = new ifpp::Block(ifpp::BLOCK_GROUP, $commandsGroup, $tags, @what.begin.line);
 }
 
 defaultRule:
 tags KW_DEFAULT[what] newlines CHR_LEFTBRACKET NEWLINE commandsDefault CHR_RIGHTBRACKET NEWLINE {
-	$$ = new ifpp::Block(ifpp::BLOCK_DEFAULT, $what, $commandsDefault, $tags);
+	$$ = new ifpp::Block(ifpp::BLOCK_DEFAULT, $commandsDefault, $tags, @what.begin.line);
 }
 
 
@@ -392,7 +440,7 @@ condition:
 | tags CON_RARITY[what] CONST_RARITY[from] CHR_DOTDOT CONST_RARITY[to] NEWLINE
 	{ $$ = magicInterval(ctx, @$, $what, $from, $to, $tags); }
 | tags CON_LIST[what] exprList[list] NEWLINE
-	{ $$ = new ifpp::ConditionNameList($what, $list, $tags); }
+	{ $$ = new ifpp::ConditionNameList($what, $list.result(), $tags); }
 | tags CON_BOOL[what] exprBool[value] NEWLINE
 	{ $$ = new ifpp::ConditionBool($what, $value, $tags); }
 | tags CON_SOCKETGROUP[what] SOCKETGROUP[value] NEWLINE
@@ -402,7 +450,8 @@ condition:
 
 action:
   tags AC_NUMBER[what] exprNumber[value] NEWLINE {
-	clampValue(ctx, @$, $what, $value, ifpp::getLimit($what, ifpp::MIN), ifpp::getLimit($what, ifpp::MAX));
+	const std::string & name = ifpp::ActionName($what);
+	clampValue(ctx, @$, name, $value, ifpp::getLimit(name, ifpp::MIN), ifpp::getLimit(name, ifpp::MAX));
 	$$ = new ifpp::ActionNumber($what, $value, $tags);
 }
 | tags AC_COLOR[what] exprColor[value] NEWLINE
@@ -418,7 +467,8 @@ action:
 | tags AC_CUSTOMSOUND[what] exprFile[file] NEWLINE
 	{ $$ = new ifpp::ActionFile($what, $file, $tags); }
 | tags AC_MINIMAPICON[what] exprNumber[size] CONST_COLOR[color] CONST_SHAPE[shape] NEWLINE {
-	clampValue(ctx, @$, $what, $size, ifpp::getLimit($what, ifpp::MIN), ifpp::getLimit($what, ifpp::MAX));
+	const std::string & name = ifpp::ActionName($what);
+	clampValue(ctx, @$, name, $size, ifpp::getLimit(name, ifpp::MIN), ifpp::getLimit(name, ifpp::MAX));
 	$$ = new ifpp::ActionMapIcon($what, $size, $color, $shape, $tags);
 }
 | tags AC_PLAYEFFECT[what] CONST_COLOR[color] NEWLINE
@@ -430,7 +480,8 @@ action:
 actionMacro:
 tags AC_USEMACRO[what] VARIABLE[varName] NEWLINE {
 	if (checkVarUse(ctx, @varName, $varName, ifpp::EXPR_MACRO)) {
-		$$ = ctx.getVarValueMacro($varName);
+		// Every use gets its own copy of the commands, blocks own (and delete) their commands.
+		for (auto c : ctx.getVarValueMacro($varName)) $$.push_back(c->clone());
 	} else {
 		YYERROR;
 	}
@@ -506,14 +557,14 @@ FILENAME { $$ = $1; }
 }
 
 exprList:
-%empty { listNew($$); }
-| exprList NAME	{ listAppend($$, $1, $2); }
+%empty { }
+| exprList NAME	{
+	std::swap($$, $1);
+	$$.add($2);
+}
 | exprList VARIABLE {
-	if (checkVarUse(ctx, @2, $2, ifpp::EXPR_LIST)) {
-		listMerge($$, $1, ctx.getVarValueList($2));
-	} else {
-		listCopy($$, $1);
-	}
+	std::swap($$, $1);
+	if (checkVarUse(ctx, @2, $2, ifpp::EXPR_LIST)) $$.add(ctx.getVarValueList($2));
 }
 
 
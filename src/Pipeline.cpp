@@ -0,0 +1,120 @@
+#include "Pipeline.h"
+#include "Scheduler.h"
+
+#include <stdexcept>
+
+namespace ifpp {
+
+Pipeline::Pipeline(Logger & l, const CompilerOptions & o, std::ostream & out) :
+	log(l), options(o), output(out), compilerMessages(), compilerLog(compilerMessages),
+	blocks(2 * (o.threads > 1 ? o.threads : 1)), rules(2),
+	errorMutex(), error(), rulesWritten(0), optimizer(o), compiler(), writer() {
+
+	compiler = std::thread(&Pipeline::compileLoop, this);
+	writer = std::thread(&Pipeline::writeLoop, this);
+}
+
+Pipeline::~Pipeline() {
+	// Nobody called finish(), so nobody is interested in the remaining blocks or errors.
+	if (compiler.joinable() || writer.joinable()) {
+		fail(std::make_exception_ptr(std::runtime_error("Pipeline abandoned.")));
+		stop();
+	}
+}
+
+void Pipeline::push(Block * block) {
+	if (!blocks.push(block)) delete block;
+}
+
+void Pipeline::finish() {
+	stop();
+
+	log.message() << compilerMessages.str();
+	log.numWarnings += compilerLog.numWarnings;
+	log.numErrors += compilerLog.numErrors;
+	log.numCritical += compilerLog.numCritical;
+
+	std::lock_guard<std::mutex> lock(errorMutex);
+	if (error) std::rethrow_exception(error);
+}
+
+void Pipeline::stop() {
+	blocks.close();
+	if (compiler.joinable()) compiler.join();
+	if (writer.joinable()) writer.join();
+}
+
+/*
+Remembers the first error and closes the queues, so that no stage waits for another one which has stopped.
+*/
+void Pipeline::fail(std::exception_ptr e) {
+	{
+		std::lock_guard<std::mutex> lock(errorMutex);
+		if (!error) error = e;
+	}
+	blocks.close();
+	rules.close();
+}
+
+void Pipeline::compileLoop() {
+	Compiler c(compilerLog, options);
+	Scheduler scheduler(options.threads);
+	bool failed = false;
+
+	Block * block = NULL;
+	while (blocks.pop(block)) {
+		// After an error the remaining blocks are only deleted.
+		if (!failed) {
+			auto * filter = new FilterNative();
+			try {
+				c.Compile(*filter, block, scheduler);
+			} catch (...) {
+				fail(std::current_exception());
+				failed = true;
+			}
+
+			if (failed || !rules.push(filter)) {
+				for (const auto r : *filter) delete r;
+				delete filter;
+				failed = true;
+			}
+		}
+		delete block;
+	}
+
+	rules.close();
+}
+
+void Pipeline::writeLoop() {
+	bool failed = false;
+
+	FilterNative * filter = NULL;
+	while (rules.pop(filter)) {
+		if (!failed) {
+			try {
+				optimizer.filter(*filter);
+				print(output, *filter);
+				rulesWritten += filter->size();
+			} catch (...) {
+				fail(std::current_exception());
+				failed = true;
+			}
+		}
+		for (const auto r : *filter) delete r;
+		delete filter;
+	}
+
+	if (!failed) {
+		FilterNative rest;
+		try {
+			optimizer.finish(rest);
+			print(output, rest);
+			rulesWritten += rest.size();
+		} catch (...) {
+			fail(std::current_exception());
+		}
+		for (const auto r : rest) delete r;
+	}
+}
+
+}
@@ -0,0 +1,121 @@
+#ifndef IFPP_PIPELINE_H
+#define IFPP_PIPELINE_H
+
+#include "Types.h"
+#include "RuleNative.h"
+#include "Logger.h"
+#include "Compiler.h"
+#include "Optimizer.h"
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <sstream>
+#include <thread>
+
+namespace ifpp {
+
+/*
+A queue with a limited capacity, passing work from one thread to another.
+Pushing into a full queue waits until there is space, popping from an empty queue waits until there is something.
+Once the queue is closed nothing can be pushed, and popping fails when the queue is empty.
+*/
+template<typename T>
+class BoundedQueue {
+public:
+	explicit BoundedQueue(size_t c) : capacity(c > 0 ? c : 1), items(), closed(false), mutex(), changed() {}
+	BoundedQueue(const BoundedQueue &) = delete;
+	BoundedQueue & operator=(const BoundedQueue &) = delete;
+
+	// Returns false if the queue was closed, the item is not added then.
+	bool push(T item) {
+		std::unique_lock<std::mutex> lock(mutex);
+		changed.wait(lock, [this]() { return closed || items.size() < capacity; });
+		if (closed) return false;
+		items.push_back(std::move(item));
+		changed.notify_all();
+		return true;
+	}
+
+	// Returns false if the queue is closed and empty.
+	bool pop(T & item) {
+		std::unique_lock<std::mutex> lock(mutex);
+		changed.wait(lock, [this]() { return closed || !items.empty(); });
+		if (items.empty()) return false;
+		item = std::move(items.front());
+		items.pop_front();
+		changed.notify_all();
+		return true;
+	}
+
+	void close() {
+		std::lock_guard<std::mutex> lock(mutex);
+		closed = true;
+		changed.notify_all();
+	}
+
+private:
+	size_t capacity;
+	std::deque<T> items;
+	bool closed;
+	std::mutex mutex;
+	std::condition_variable changed;
+};
+
+/*
+Compiles and writes top-level blocks while the parser is still producing them.
+
+The parser pushes every finished top-level block, a compiler thread compiles the blocks in order
+and a writer thread writes the rules to the output. The queues between the stages are bounded,
+so a fast stage waits for a slow one instead of piling up blocks or rules in memory.
+Blocks are deleted as soon as they are compiled, rules as soon as they are written.
+
+Messages of the compiler are collected and added to the log by finish(), the log is not safe to share between threads.
+*/
+class Pipeline {
+public:
+	Pipeline(Logger & l, const CompilerOptions & o, std::ostream & out);
+	Pipeline(const Pipeline &) = delete;
+	Pipeline & operator=(const Pipeline &) = delete;
+	~Pipeline();
+
+	// Takes ownership of the block. After an error in a later stage the block is simply deleted.
+	void push(Block * block);
+
+	// Waits until all blocks are compiled and written. Rethrows the first error of any stage.
+	void finish();
+
+	size_t numRules() const { return rulesWritten; }
+	const OutputOptimizer & optimizations() const { return optimizer; }
+
+private:
+	void compileLoop();
+	void writeLoop();
+	void fail(std::exception_ptr e);
+	void stop();
+
+	Logger & log;
+	CompilerOptions options;
+	std::ostream & output;
+
+	std::stringstream compilerMessages;
+	Logger compilerLog;
+
+	BoundedQueue<Block *> blocks;
+	BoundedQueue<FilterNative *> rules;
+
+	std::mutex errorMutex;
+	std::exception_ptr error;
+	size_t rulesWritten;
+	OutputOptimizer optimizer; // Only used by the writer.
+
+	std::thread compiler;
+	std::thread writer;
+};
+
+}
+
+#endif
@@ -1,72 +1,143 @@
 #include "RuleNative.h"
 
+#include <algorithm>
+#include <climits>
+
 namespace ifpp {
 
 /***********
-* TESTING CONTAINMENT OF CONDITIONS
+* KINDS OF CONDITIONS AND ACTIONS
 ***********/
 
-static bool ConditionSubset(const ConditionInterval * small, const ConditionInterval * large) {
-	return large->from <= small->from && small->to <= large->to;
+// Indexed by ConditionKind.
+static const ConditionType CONDITION_TYPES[CK_COUNT] = {
+	CON_BOOL, // AnyEnchantment
+	CON_NAMELIST, // BaseType
+	CON_NAMELIST, // Class
+	CON_BOOL, // Corrupted
+	CON_INTERVAL, // DropLevel
+	CON_BOOL, // ElderItem
+	CON_BOOL, // FracturedItem
+	CON_INTERVAL, // GemLevel
+	CON_NAMELIST, // HasEnchantment
+	CON_NAMELIST, // HasExplicitMod
+	CON_INTERVAL, // Height
+	CON_BOOL, // Identified
+	CON_INTERVAL, // ItemLevel
+	CON_INTERVAL, // LinkedSockets
+	CON_INTERVAL, // MapTier
+	CON_NAMELIST, // Prophecy
+	CON_INTERVAL, // Quality
+	CON_INTERVAL, // Rarity
+	CON_BOOL, // ShapedMap
+	CON_BOOL, // ShaperItem
+	CON_SOCKETGROUP, // SocketGroup
+	CON_INTERVAL, // Sockets
+	CON_INTERVAL, // StackSize
+	CON_BOOL, // SynthesisedItem
+	CON_INTERVAL // Width
+};
+
+// The kinds of conditions of a type, one bit per kind.
+static unsigned KindsOfType(ConditionType type) {
+	unsigned mask = 0;
+	for (int k = 0; k < CK_COUNT; ++k) {
+		if (CONDITION_TYPES[k] == type) mask |= 1u << k;
+	}
+	return mask;
 }
 
-static bool ConditionSubset(const ConditionBool * small, const ConditionBool * large) {
-	return small->value == large->value;
+static const unsigned BOOL_KINDS = KindsOfType(CON_BOOL);
+static const unsigned INTERVAL_KINDS = KindsOfType(CON_INTERVAL);
+
+ConditionType ConditionKindType(ConditionKind k) {
+	return CONDITION_TYPES[k];
 }
 
-static bool ConditionSubset(const ConditionNameList * small, const ConditionNameList * large)
-{
-	// True if every string in the small list is matched by some string in the large list.
-	for (const auto & s1 : small->nameList) {
-		bool matched = false;
-		for (const auto & s2 : large->nameList) {
-			if (s1.find(s2) != std::string::npos) {
-				// Anything matching s1 can also be matched by s2.
-				matched = true;
-				break;
-			}
+const std::pair<int, int> & ConditionLimits(ConditionKind k) {
+	// Indexed by ConditionKind, built on first use.
+	static const std::vector<std::pair<int, int> > limits = []() {
+		std::vector<std::pair<int, int> > l(CK_COUNT, std::make_pair(INT_MIN, INT_MAX));
+		for (int k = 0; k < CK_COUNT; ++k) {
+			if (CONDITION_TYPES[k] != CON_INTERVAL) continue;
+			const std::string & name = ConditionName(static_cast<ConditionKind>(k));
+			l[k] = std::make_pair(getLimit(name, MIN), getLimit(name, MAX));
 		}
-		if (!matched) return false; // This string can not be matched by the large list.
+		return l;
+	}();
+	return limits[k];
+}
+
+bool ActionKindHasText(ActionKind k) {
+	switch (k) {
+		case AK_CUSTOMALERTSOUND:
+		case AK_MINIMAPICON:
+		case AK_PLAYALERTSOUND:
+		case AK_PLAYALERTSOUNDPOSITIONAL:
+		case AK_PLAYEFFECT:
+			return true;
+		default:
+			return false;
 	}
-	return true;
 }
 
-static bool ConditionSubset(const ConditionSocketGroup * small, const ConditionSocketGroup * large) {
-	// True if the small condition needs fewer or equal sockets of every color.
-	if (small->socketGroup.r > large->socketGroup.r) return false;
-	if (small->socketGroup.g > large->socketGroup.g) return false;
-	if (small->socketGroup.b > large->socketGroup.b) return false;
-	if (small->socketGroup.w > large->socketGroup.w) return false;
-	return true;
+unsigned PackColor(const Color & c) {
+	// Color values are clamped to 0 .. 255 by the parser.
+	return (c.r & 0xFF) | (c.g & 0xFF) << 8 | (c.b & 0xFF) << 16 | static_cast<unsigned>(c.a & 0xFF) << 24;
+}
+
+Color UnpackColor(unsigned packed) {
+	return Color(packed & 0xFF, packed >> 8 & 0xFF, packed >> 16 & 0xFF, packed >> 24 & 0xFF);
+}
+
+unsigned PackSocketGroup(const SocketGroup & sg) {
+	// Groups with more than 255 sockets of a color do not match anything either way.
+	auto byte = [](int x) { return static_cast<unsigned>(std::min(x, 0xFF)); };
+	return byte(sg.r) | byte(sg.g) << 8 | byte(sg.b) << 16 | byte(sg.w) << 24;
+}
+
+SocketGroup UnpackSocketGroup(unsigned packed) {
+	SocketGroup sg;
+	sg.r = packed & 0xFF;
+	sg.g = packed >> 8 & 0xFF;
+	sg.b = packed >> 16 & 0xFF;
+	sg.w = packed >> 24 & 0xFF;
+	return sg;
+}
+
+/***********
+* TESTING CONTAINMENT OF CONDITIONS
+***********/
+
+static bool ConditionSubset(const ConditionSlot & small, const ConditionSlot & large, ConditionKind k) {
+	if (ConditionKindType(k) == CON_BOOL) return small.from == large.from;
+	return large.from <= small.from && small.to <= large.to;
 }
 
-static bool ConditionSubset(const Condition * small, const Condition * large) {
-	if (!small || !large) {
-		throw InternalError("Attempting to test containment of a NULL condition!", __FILE__, __LINE__);
+static bool NameListSubset(const SharedNames & small, const SharedNames & large) {
+	// Equal lists are the same list.
+	if (small == large) return true;
+
+	// True if every string in the small list is matched by some string in the large list,
+	// that is, contains it: anything matching s1 can then also be matched by s2.
+	return small->subsetOf(*large);
+}
+
+static bool SocketGroupSubset(unsigned small, unsigned large) {
+	// A socket group matches items with at least as many sockets of every color, so needing more matches fewer items.
+	// True if the small condition needs more or equal sockets of every color.
+	for (int shift = 0; shift < 32; shift += 8) {
+		if ((small >> shift & 0xFF) < (large >> shift & 0xFF)) return false;
 	}
-	if (small->what != large->what) {
+	return true;
+}
+
+static bool ConditionSubset(const ListCondition & small, const ListCondition & large) {
+	if (small.kind != large.kind) {
 		throw InternalError("Attempting to test containment of conditions of different type!", __FILE__, __LINE__);
 	}
-	switch (small->conType) {
-		case CON_INTERVAL:
-			return ConditionSubset(
-				static_cast<const ConditionInterval *>(small),
-				static_cast<const ConditionInterval *>(large));
-		case CON_BOOL:
-			return ConditionSubset(
-				static_cast<const ConditionBool *>(small),
-				static_cast<const ConditionBool *>(large));
-		case CON_NAMELIST:
-			return ConditionSubset(
-				static_cast<const ConditionNameList *>(small),
-				static_cast<const ConditionNameList *>(large));
-		case CON_SOCKETGROUP:
-			return ConditionSubset(
-				static_cast<const ConditionSocketGroup *>(small),
-				static_cast<const ConditionSocketGroup *>(large));
-		default:
-			throw UnhandledCase("Condition type", __FILE__, __LINE__);
-	}
+	if (small.kind == CK_SOCKETGROUP) return SocketGroupSubset(small.sockets, large.sockets);
+	return NameListSubset(small.names, large.names);
 }
 
 /*
@@ -77,237 +148,444 @@ I.e. anything that is matched by small is also matched by large.
 (Multiple conditions are interpreted as conjunction.)
 */
 bool RuleSubset(const RuleNative * small, const RuleNative * large) {
-	for (const auto ci : small->conditions) {
-		const Condition * c = ci.second;
+	// Check that the large rule does not contain any extra conditions.
+	if (large->conditionMask & ~small->conditionMask) return false;
 
-		auto range = large->conditions.equal_range(c->what);
-		if (range.first == range.second) {
-			// The large rule does not have this condition, i.e. matches everything.
-			continue;
-		}
+	// Conditions the large rule does not have match everything.
+	const unsigned common = small->conditionMask & large->conditionMask;
 
-		for (auto ci2 = range.first; ci2 != range.second; ci2++) {
-			if (!ConditionSubset(c, ci2->second)) {
-				return false;
-			}
-		}
+	// Bool conditions must have the same value.
+	if ((small->trueMask ^ large->trueMask) & common & BOOL_KINDS) return false;
+
+	const unsigned intervals = common & INTERVAL_KINDS;
+	for (int k = 0; k < CK_COUNT && intervals >> k; ++k) {
+		if (!(intervals & 1u << k)) continue;
+		if (!ConditionSubset(small->conditions[k], large->conditions[k], static_cast<ConditionKind>(k))) return false;
 	}
-	// All conditions have been matched.
 
-	for (const auto ci2 : large->conditions) {
-		// Check that the large rule does not contain any extra conditions.
-		if (small->conditions.find(ci2.first) == small->conditions.end()) {
-			return false;
+	if (!(common & ~(BOOL_KINDS | INTERVAL_KINDS))) return true;
+	for (const auto & c : small->lists) {
+		if (!(common & 1u << c.kind)) continue;
+		for (const auto & c2 : large->lists) {
+			if (c2.kind == c.kind && !ConditionSubset(c, c2)) return false;
 		}
 	}
 
+	// All conditions have been matched.
 	return true;
 }
 
+/*
+Decides what addConditions would, for interval and bool conditions.
+Name lists never make a rule useless, and socket groups are left to addConditions,
+so a rule is only reported disjoint if it really would be useless, but not always when it would.
+
+A useless rule stays useless, anything added to it.
+*/
+bool RuleDisjoint(const RuleNative * rule, const RuleNative * modifier) {
+	if (rule->useless) return true;
+
+	// Conditions of both, which the modifier intersects with those of the rule.
+	const unsigned both = rule->conditionMask & modifier->conditionMask & ~rule->finalMask & ~modifier->overrideMask;
+
+	// A bool condition can not be true and false at the same time.
+	if ((rule->trueMask ^ modifier->trueMask) & both & BOOL_KINDS) return true;
+
+	const unsigned intervals = modifier->conditionMask & INTERVAL_KINDS;
+	for (int k = 0; k < CK_COUNT && intervals >> k; ++k) {
+		if (!(intervals & 1u << k)) continue;
+
+		// Otherwise the condition of the modifier is taken as it is, unless the rule has a final one.
+		const ConditionSlot & mod = modifier->conditions[k];
+		if (both & 1u << k) {
+			const ConditionSlot & slot = rule->conditions[k];
+			if (std::max(slot.from, mod.from) > std::min(slot.to, mod.to)) return true;
+		} else if (!(rule->finalMask & 1u << k) && mod.from > mod.to) {
+			return true;
+		}
+	}
+	return false;
+}
+
 
 /***********
 * RULENATIVE
 ***********/
 
-static bool ConditionUseless(const Condition * c) {
-	switch (c->conType) {
-		case CON_INTERVAL: {
-			auto ci = static_cast<const ConditionInterval *>(c);
-			return ci->from > ci->to;
-		}
-		case CON_SOCKETGROUP: {
-			auto csg = static_cast<const ConditionSocketGroup *>(c);
-			return
-				csg->socketGroup.r
-				+ csg->socketGroup.g
-				+ csg->socketGroup.b
-				+ csg->socketGroup.w
-				> getLimit("LinkedSockets", MAX);
-		}
-		case CON_BOOL: // Always matches something.
-		case CON_NAMELIST: // We can not determine what this matches.
-			return false;
-		default:
-			throw UnhandledCase("Condition type", __FILE__, __LINE__);
-	}
+static bool ConditionUseless(const ListCondition & c) {
+	if (c.kind != CK_SOCKETGROUP) return false; // We can not determine what a name list matches.
+	SocketGroup sg = UnpackSocketGroup(c.sockets);
+	return sg.r + sg.g + sg.b + sg.w > getLimit("LinkedSockets", MAX);
 }
 
 /*
-Always adds a clone of c, if necessary.
+Adds an interval or bool condition.
 */
-void RuleNative::addCondition(const Condition * c) {
-	auto cOld = conditions.find(c->what);
+void RuleNative::addValue(ConditionKind k, int from, int to, TagList t) {
+	const bool interval = ConditionKindType(k) == CON_INTERVAL;
+	ConditionSlot & slot = conditions[k];
 
-	if (cOld == conditions.end()) {
+	if (!hasCondition(k)) {
 		// We do not have this type of condition yet.
-
-		// Add the condition and take ownership.
-		conditions.insert(std::make_pair(c->what, static_cast<Condition *>(c->clone())));
+		setValue(k, ConditionSlot{from, to, t});
 
 		// Check if the condition matches anything.
 		// We still add it though.
-		if (ConditionUseless(c)) useless = true;
+		if (interval && from > to) useless = true;
 		return;
 	}
 
-	if (cOld->second->hasTag(TAG_FINAL)) {
+	if (slot.tags & TAG_FINAL) {
 		// Do not override final conditions.
 		return;
 	}
 
 	// Override - replace the condition.
-	if (c->hasTag(TAG_OVERRIDE)) {
-		delete cOld->second;
-		cOld->second = static_cast<Condition *>(c->clone());
+	if (t & TAG_OVERRIDE) {
+		setValue(k, ConditionSlot{from, to, t});
+		if (interval && from > to) useless = true;
+		return;
+	}
+
+	// Intersect with the old condition.
+	if (interval) {
+		// Refine the interval in existing condition.
+		if (slot.from < from) slot.from = from;
+		if (slot.to > to) slot.to = to;
+		if (slot.from > slot.to) useless = true;
+	} else {
+		// A condition can not be true and false at the same time.
+		if (slot.from != from) useless = true;
+	}
+}
+
+void RuleNative::setValue(ConditionKind k, const ConditionSlot & slot) {
+	const unsigned bit = 1u << k;
+	conditions[k] = slot;
+	conditionMask |= bit;
+	trueMask = ConditionKindType(k) == CON_BOOL && slot.from ? trueMask | bit : trueMask & ~bit;
+	finalMask = slot.tags & TAG_FINAL ? finalMask | bit : finalMask & ~bit;
+	overrideMask = slot.tags & TAG_OVERRIDE ? overrideMask | bit : overrideMask & ~bit;
+}
+
+/*
+Adds a name list or socket group condition.
+*/
+void RuleNative::addList(const ListCondition & c) {
+	// The conditions of this kind.
+	size_t first = std::lower_bound(lists.begin(), lists.end(), c.kind,
+		[](const ListCondition & l, ConditionKind k) { return l.kind < k; }) - lists.begin();
+	size_t last = first;
+	while (last < lists.size() && lists[last].kind == c.kind) ++last;
+
+	if (first == last) {
+		// We do not have this type of condition yet.
+		conditionMask |= 1u << c.kind;
+		lists.insert(lists.begin() + first, c);
 		if (ConditionUseless(c)) useless = true;
 		return;
 	}
 
-	// Intersect with the old condition
-	switch (c->conType) {
-		case CON_INTERVAL: {
-			// Refine the interval in existing condition.
-			auto c1 = static_cast<ConditionInterval *>(cOld->second);
-			auto c2 = static_cast<const ConditionInterval *>(c);
+	if (lists[first].tags & TAG_FINAL) {
+		// Do not override final conditions.
+		return;
+	}
 
-			if (c1->from < c2->from) c1->from = c2->from;
-			if (c1->to > c2->to) c1->to = c2->to;
-			if (c1->from > c1->to) useless = true;
-			break;
+	// Override - replace the condition.
+	if (c.tags & TAG_OVERRIDE) {
+		lists[first] = c;
+		if (ConditionUseless(c)) useless = true;
+		return;
+	}
+
+	// There can be more than one of these conditions, in case of intersections.
+	SocketGroup sg = UnpackSocketGroup(c.sockets);
+	bool add = true;
+	for (size_t i = first; i < last; ) {
+		if (c.kind == CK_SOCKETGROUP) {
+			// Check if we need more than 6 different sockets.
+			SocketGroup sg2 = UnpackSocketGroup(lists[i].sockets);
+			if (sg2.r > sg.r) sg.r = sg2.r;
+			if (sg2.g > sg.g) sg.g = sg2.g;
+			if (sg2.b > sg.b) sg.b = sg2.b;
+			if (sg2.w > sg.w) sg.w = sg2.w;
 		}
-		case CON_BOOL: {
-			// A condition can not be true and false at the same time.
-			auto c1 = static_cast<const ConditionBool *>(cOld->second);
-			auto c2 = static_cast<const ConditionBool *>(c);
 
-			if (c1->value != c2->value) useless = true;
+		// If some existing condition is stricter than the new condition, we do not need to do anything.
+		if (ConditionSubset(lists[i], c)) {
+			add = false;
 			break;
 		}
-		case CON_SOCKETGROUP: {
-			auto c1 = static_cast<const ConditionSocketGroup *>(c);
-			int r = c1->socketGroup.r;
-			int g = c1->socketGroup.g;
-			int b = c1->socketGroup.b;
-			int w = c1->socketGroup.w;
-
-			bool add = true;
-			auto range = conditions.equal_range(c->what);
-			for (auto it = range.first; it != range.second; ) {
-				// Check if we need more than 6 different sockets.
-				auto c2 = static_cast<ConditionSocketGroup *>(it->second);
-				if (c2->socketGroup.r > r) r = c2->socketGroup.r;
-				if (c2->socketGroup.g > g) g = c2->socketGroup.g;
-				if (c2->socketGroup.b > b) b = c2->socketGroup.b;
-				if (c2->socketGroup.w > w) w = c2->socketGroup.w;
-
-				// If some existing condition is stricter than the new condition, we do not need to do anything.
-				if (ConditionSubset(c2, c1)) {
-					add = false;
-					break;
-				}
-				// If the new condition is stricter than some existing condition, we can remove the existing one.
-				if (ConditionSubset(c1, c2)) {
-					delete it->second;
-					it = conditions.erase(it);
-				} else {
-					++it;
-				}
-			}
+		// If the new condition is stricter than some existing condition, we can remove the existing one.
+		if (ConditionSubset(c, lists[i])) {
+			lists.erase(lists.begin() + i);
+			--last;
+		} else {
+			++i;
+		}
+	}
 
-			// Check if we need more than 6 different sockets.
-			if (r + g + b + w > getLimit("LinkedSockets", MAX)) useless = true;
+	if (c.kind == CK_SOCKETGROUP && sg.r + sg.g + sg.b + sg.w > getLimit("LinkedSockets", MAX)) useless = true;
 
-			// Add the new condition.
-			if (add) {
-				conditions.insert(std::make_pair(c->what, static_cast<Condition *>(c->clone())));
-			}
+	// Add the new condition.
+	if (add) lists.insert(lists.begin() + last, c);
+}
+
+/*
+Always adds a copy of c, if necessary.
+*/
+void RuleNative::addCondition(const Condition * c) {
+	const ConditionKind k = c->kind;
+	if (ConditionKindType(k) != c->conType) {
+		throw InternalError("Condition " + c->name() + " has an unexpected type!", __FILE__, __LINE__);
+	}
+
+	switch (c->conType) {
+		case CON_INTERVAL: {
+			auto ci = static_cast<const ConditionInterval *>(c);
+			addValue(k, ci->from, ci->to, c->tags);
 			break;
 		}
-		case CON_NAMELIST: {
-			// There can be more than one of these conditions, in case of intersections.
-			auto c1 = static_cast<const ConditionNameList *>(c);
-
-			bool add = true;
-			auto range = conditions.equal_range(c->what);
-			for (auto it = range.first; it != range.second; ) {
-				auto c2 = static_cast<ConditionNameList *>(it->second);
-
-				// If some existing condition is stricter than the new condition, we do not need to do anything.
-				if (ConditionSubset(c2, c1)) {
-					add = false;
-					break;
-				}
-				// If the new condition is stricter than some existing condition, we can remove the existing one.
-				if (ConditionSubset(c1, c2)) {
-					delete it->second;
-					it = conditions.erase(it);
-				} else {
-					++it;
-				}
-			}
-
-			// Add the new condition.
-			if (add) {
-				conditions.insert(std::make_pair(c->what, static_cast<Condition *>(c->clone())));
-			}
+		case CON_BOOL: {
+			auto cb = static_cast<const ConditionBool *>(c);
+			addValue(k, cb->value, cb->value, c->tags);
 			break;
 		}
+		case CON_NAMELIST:
+			addList(ListCondition{k, c->tags, 0, static_cast<const ConditionNameList *>(c)->nameList});
+			break;
+		case CON_SOCKETGROUP:
+			addList(ListCondition{k, c->tags, PackSocketGroup(static_cast<const ConditionSocketGroup *>(c)->socketGroup), SharedNames()});
+			break;
 		default:
 			throw UnhandledCase("Condition type", __FILE__, __LINE__);
 	}
 }
 
+void RuleNative::addConditions(const RuleNative & other) {
+	// In the order the conditions are printed, as if other was printed and parsed again.
+	auto list = other.lists.begin();
+	for (int k = 0; k < CK_COUNT && !useless; ++k) {
+		if (!other.hasCondition(static_cast<ConditionKind>(k))) continue;
+
+		ConditionType type = ConditionKindType(static_cast<ConditionKind>(k));
+		if (type == CON_NAMELIST || type == CON_SOCKETGROUP) {
+			while (list != other.lists.end() && list->kind < k) ++list;
+			for (; list != other.lists.end() && list->kind == k && !useless; ++list) addList(*list);
+		} else {
+			const ConditionSlot & slot = other.conditions[k];
+			addValue(static_cast<ConditionKind>(k), slot.from, slot.to, slot.tags);
+		}
+	}
+}
+
 /*
-Adds a clone of the action.
 If the action has the Override tag, replaces an existing action with the same name.
 Otherwise the old action is preserved.
 */
+void RuleNative::addAction(ActionKind k, TagList t, int value, const SharedStrings & text) {
+	if (hasAction(k)) {
+		const TagList old = actions[k].tags;
+
+		if (old & TAG_FINAL) {
+			// Cannot override Final actions.
+			return;
+		}
+
+		// Replace the old action.
+		// Note that replacing a removed action with another removed action is possible,
+		// if the newer removed action has different tags.
+		if (!(old & TAG_REMOVE) && !(t & TAG_REMOVE) && !(t & TAG_OVERRIDE)) return;
+	}
+
+	actionMask |= 1u << k;
+	actions[k] = ActionSlot{t, value, text};
+}
+
+/*
+Adds a copy of the action.
+*/
 void RuleNative::addAction(const Action * a) {
-	// Possibly override other actions of the same type.
-	auto it = actions.find(a->what);
+	const ActionKind k = a->kind;
 
-	if (it == actions.end()) {
-		// Add a new action.
-		actions.insert(std::make_pair(a->what, static_cast<Action *>(a->clone())));
+	if (a->hasTag(TAG_REMOVE)) {
+		addAction(k, a->tags, 0, SharedStrings());
 		return;
 	}
 
-	if (it->second->hasTag(TAG_FINAL)) {
-		// Cannot override Final actions.
-		return;
+	// The parser creates actions of the type given by their name.
+	switch (k) {
+		case AK_SETFONTSIZE:
+			addAction(k, a->tags, static_cast<const ActionNumber *>(a)->arg1, SharedStrings());
+			break;
+		case AK_SETBACKGROUNDCOLOR:
+		case AK_SETBORDERCOLOR:
+		case AK_SETTEXTCOLOR:
+			addAction(k, a->tags, PackColor(static_cast<const ActionColor *>(a)->arg1), SharedStrings());
+			break;
+		case AK_DISABLEDROPSOUND:
+		case AK_HIDDEN:
+			addAction(k, a->tags, static_cast<const ActionBool *>(a)->arg1, SharedStrings());
+			break;
+		case AK_CUSTOMALERTSOUND: {
+			addAction(k, a->tags, 0, SharedStrings(NameList{static_cast<const ActionFile *>(a)->arg1, ""}));
+			break;
+		}
+		case AK_PLAYALERTSOUND:
+		case AK_PLAYALERTSOUNDPOSITIONAL: {
+			auto as = static_cast<const ActionSound *>(a);
+			addAction(k, a->tags, as->arg2, SharedStrings(NameList{as->arg1, ""}));
+			break;
+		}
+		case AK_PLAYEFFECT: {
+			auto ae = static_cast<const ActionEffect *>(a);
+			addAction(k, a->tags, 0, SharedStrings(NameList{ae->arg1, ae->arg2}));
+			break;
+		}
+		case AK_MINIMAPICON: {
+			auto am = static_cast<const ActionMapIcon *>(a);
+			addAction(k, a->tags, am->arg1, SharedStrings(NameList{am->arg2, am->arg3}));
+			break;
+		}
+		default:
+			throw UnhandledCase("Action kind", __FILE__, __LINE__);
 	}
-	
-	if (it->second->hasTag(TAG_REMOVE) || a->hasTag(TAG_REMOVE) || a->hasTag(TAG_OVERRIDE)) {
-		// Replace the old action.
-		// Note that replacing a removed action with another removed action is possible,
-		// if the newer removed action has different tags.
-		delete it->second;
-		it->second = static_cast<Action *>(a->clone());
+}
+
+void RuleNative::addActions(const RuleNative & other) {
+	for (int k = 0; k < AK_COUNT; ++k) {
+		if (!other.hasAction(static_cast<ActionKind>(k))) continue;
+
+		const ActionSlot & slot = other.actions[k];
+		addAction(static_cast<ActionKind>(k), slot.tags, slot.value, slot.text);
+	}
+}
+
+bool ActionSlot::operator==(const ActionSlot & other) const {
+	const TagList relevant = TAG_FINAL | TAG_REMOVE;
+	return (tags & relevant) == (other.tags & relevant) && value == other.value && text == other.text;
+}
+
+bool SameActions(const RuleNative * first, const RuleNative * second) {
+	if (first->actionMask != second->actionMask) return false;
+	for (int k = 0; k < AK_COUNT; ++k) {
+		if (first->hasAction(static_cast<ActionKind>(k)) && first->actions[k] != second->actions[k]) return false;
 	}
+	return true;
 }
 
 bool RuleNative::hasTag(TagList t) const {
 	return tags & t;
 }
 
+static std::ostream & PrintInterval(std::ostream & os, ConditionKind k, int from, int to) {
+	const std::string & what = ConditionName(k);
+	const std::string prefix = std::string(IFPP_TABS, '\t') + what;
+	if (k == CK_RARITY) {
+		if (from > to) throw InternalError("Condition " + what + " has inverted range!", __FILE__, __LINE__);
+		if (to < Normal || from > Unique) throw InternalError("Condition " + what + " does not match any value!", __FILE__, __LINE__);
+		if (from == INT_MIN && to == INT_MAX) throw InternalError("Condition " + what + " matches all possible values!", __FILE__, __LINE__);
+		if (from == INT_MIN) return os << prefix << " <= " << (Rarity)to << std::endl;
+		if (to == INT_MAX) return os << prefix << " >= " << (Rarity)from << std::endl;
+		if (from == to) return os << prefix << " = " << (Rarity)from << std::endl;
+
+		os << prefix << " >= " << (Rarity)from << std::endl;
+		os << prefix << " <= " << (Rarity)to << std::endl;
+		return os;
+	}
+	else {
+		if (from > to) throw InternalError("Condition " + what + " has inverted range!", __FILE__, __LINE__);
+		if (to < 0) throw InternalError("Condition " + what + " does not match any value!", __FILE__, __LINE__);
+		if (from == INT_MIN && to == INT_MAX) throw InternalError("Condition " + what + " matches all possible values!", __FILE__, __LINE__);
+		if (from == INT_MIN) return os << prefix << " <= " << to << std::endl;
+		if (to == INT_MAX) return os << prefix << " >= " << from << std::endl;
+		if (from == to) return os << prefix << " = " << from << std::endl;
+
+		os << prefix << " >= " << from << std::endl;
+		os << prefix << " <= " << to << std::endl;
+		return os;
+	}
+}
+
 std::ostream & RuleNative::printSelf(std::ostream & os) const {
 	if (useless) {
 		throw InternalError("Writing a useless rule to native filter!", __FILE__, __LINE__);
 	}
 
-	auto it = actions.find("Hidden");
-	if (it != actions.end() && static_cast<ActionBool *>(it->second)->arg1) {
+	if (hasAction(AK_HIDDEN) && !(actions[AK_HIDDEN].tags & TAG_REMOVE) && actions[AK_HIDDEN].value) {
 		os << "Hide" << std::endl;
 	} else {
 		os << "Show" << std::endl;
 	}
 
 	++IFPP_TABS;
-	for (const auto & c : conditions) {
-		print(os, c.second);
+	const std::string tabs(IFPP_TABS, '\t');
+
+	for (int k = 0; k < CK_COUNT; ++k) {
+		if (!hasCondition(static_cast<ConditionKind>(k))) continue;
+
+		const std::string & name = ConditionName(static_cast<ConditionKind>(k));
+		const ConditionSlot & slot = conditions[k];
+		switch (ConditionKindType(static_cast<ConditionKind>(k))) {
+			case CON_INTERVAL:
+				PrintInterval(os, static_cast<ConditionKind>(k), slot.from, slot.to);
+				break;
+			case CON_BOOL:
+				os << tabs << name << (slot.from ? " true" : " false") << std::endl;
+				break;
+			case CON_NAMELIST:
+			case CON_SOCKETGROUP:
+				for (const auto & c : lists) {
+					if (c.kind != k) continue;
+					os << tabs << name << ' ';
+					if (c.kind == CK_SOCKETGROUP) os << UnpackSocketGroup(c.sockets);
+					else os << c.names;
+					os << std::endl;
+				}
+				break;
+			default:
+				throw UnhandledCase("Condition type", __FILE__, __LINE__);
+		}
 	}
-	for (const auto & a : actions) {
-		if (a.second->what != "Remove") print(os, a.second);
+
+	for (int k = 0; k < AK_COUNT; ++k) {
+		// Removed actions are not printed.
+		if (!hasAction(static_cast<ActionKind>(k)) || actions[k].tags & TAG_REMOVE) continue;
+
+		const std::string & name = ActionName(static_cast<ActionKind>(k));
+		const ActionSlot & slot = actions[k];
+		switch (k) {
+			case AK_HIDDEN:
+				// Do not print Hidden to native filters, this is handled above.
+				break;
+			case AK_DISABLEDROPSOUND:
+				// Print this action only if it is true.
+				if (slot.value) os << tabs << name << std::endl;
+				break;
+			case AK_SETFONTSIZE:
+				os << tabs << name << ' ' << slot.value << std::endl;
+				break;
+			case AK_SETBACKGROUNDCOLOR:
+			case AK_SETBORDERCOLOR:
+			case AK_SETTEXTCOLOR:
+				os << tabs << name << ' ' << UnpackColor(slot.value) << std::endl;
+				break;
+			case AK_CUSTOMALERTSOUND:
+				os << tabs << name << ' ' << (*slot.text)[0] << std::endl;
+				break;
+			case AK_PLAYALERTSOUND:
+			case AK_PLAYALERTSOUNDPOSITIONAL:
+				os << tabs << name << ' ' << (*slot.text)[0] << ' ' << slot.value << std::endl;
+				break;
+			case AK_PLAYEFFECT:
+				os << tabs << name << ' ' << (*slot.text)[0] << ' ' << (*slot.text)[1] << std::endl;
+				break;
+			case AK_MINIMAPICON:
+				os << tabs << name << ' ' << slot.value << ' ' << (*slot.text)[0] << ' ' << (*slot.text)[1] << std::endl;
+				break;
+			default:
+				throw UnhandledCase("Action kind", __FILE__, __LINE__);
+		}
 	}
 	--IFPP_TABS;
 	os << std::endl;
@@ -315,25 +593,18 @@ std::ostream & RuleNative::printSelf(std::ostream & os) const {
 	return os;
 }
 
-RuleNative * RuleNative::clone() const {
-	// We do not need to do checking, just copy the conditions and actions.
-	// Beware, this might break if addCondition or addAction start to do other things.
-	RuleNative * r = new RuleNative(tags);
-	r->useless = useless;
-
-	for (const auto & c : conditions) {
-		r->conditions.insert(std::make_pair(c.first, static_cast<Condition *>(c.second->clone())));
-	}
-	for (const auto & a : actions) {
-		r->actions.insert(std::make_pair(a.first, static_cast<Action *>(a.second->clone())));
-	}
+void * RuleNative::operator new(size_t size) {
+	return size == sizeof(RuleNative) ? Arena<RuleNative>::allocate() : ::operator new(size);
+}
 
-	return r;
+void RuleNative::operator delete(void * p, size_t size) {
+	if (size == sizeof(RuleNative)) Arena<RuleNative>::deallocate(p);
+	else ::operator delete(p);
 }
 
-RuleNative::~RuleNative() {
-	for (auto & c : conditions) delete c.second;
-	for (auto & a : actions) delete a.second;
+RuleNative * RuleNative::clone() const {
+	// The slots are plain values, the name lists and the strings of actions are shared.
+	return new RuleNative(*this);
 }
 
-}
\ No newline at end of file
+}
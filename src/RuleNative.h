@@ -2,44 +2,145 @@
 #define IFPP_RULENATIVE_H
 
 #include "Types.h"
+#include "Arena.h"
+#include <memory>
 #include <string>
+#include <utility>
 #include <vector>
-#include <map>
 
 namespace ifpp {
 
+// CON_INTERVAL (Rarity included), CON_BOOL, CON_NAMELIST or CON_SOCKETGROUP.
+ConditionType ConditionKindType(ConditionKind k);
+
+// The values an interval condition can take (see getLimit). Other kinds can take any value.
+const std::pair<int, int> & ConditionLimits(ConditionKind k);
+
+// True for actions with strings: sounds, effects and minimap icons.
+bool ActionKindHasText(ActionKind k);
+
+// Colors and socket groups packed into 32 bits, one byte per component.
+unsigned PackColor(const Color & c);
+Color UnpackColor(unsigned packed);
+unsigned PackSocketGroup(const SocketGroup & sg);
+SocketGroup UnpackSocketGroup(unsigned packed);
+
+/*
+An interval or bool condition, stored in the rule itself.
+A bool condition keeps its value in from (and to).
+*/
+struct ConditionSlot {
+	int from, to;
+	TagList tags;
+};
+
+/*
+A name list or socket group condition. A rule can have several of these of the same kind, in case of intersections.
+*/
+struct ListCondition {
+	ListCondition(ConditionKind k, TagList t, unsigned sg, const SharedNames & nl) :
+		kind(k), tags(t), sockets(sg), names(nl) {}
+
+	ConditionKind kind;
+	TagList tags;
+	unsigned sockets; // Packed socket group.
+	SharedNames names;
+};
+
+// Strings of actions, shared like name lists but not indexed.
+typedef Shared<NameList, NameListHash> SharedStrings;
+
+/*
+An action, stored in the rule itself except for its strings.
+A removed action has TAG_REMOVE and no value.
+*/
+struct ActionSlot {
+	ActionSlot() : tags(0), value(0), text() {}
+	ActionSlot(TagList t, int v, const SharedStrings & s) : tags(t), value(v), text(s) {}
+
+	// The same action, which also treats actions added later the same way. Of the tags only Final and Remove matter.
+	bool operator==(const ActionSlot & other) const;
+	bool operator!=(const ActionSlot & other) const { return !(*this == other); }
+
+	TagList tags;
+	int value; // Font size, packed color, bool, sound volume or minimap icon size.
+	SharedStrings text; // The two strings of sounds, effects and minimap icons, empty for other actions.
+};
+
 // Native rule, but keeps tags.
 // Only one action per type allowed.
 // No nested rules.
 struct RuleNative {
-	RuleNative(TagList t = 0) : tags(t), conditions(), actions(), useless(false) {}
-	
+	RuleNative(TagList t = 0) :
+		tags(t), conditionMask(0), actionMask(0), trueMask(0), finalMask(0), overrideMask(0),
+		conditions(), lists(), actions(), useless(false) {}
+
 	void addCondition(const Condition * c);
 	void addAction(const Action * a);
-	
+
+	// Add all conditions (stopping when the rule becomes useless) or all actions of another rule, in order.
+	void addConditions(const RuleNative & other);
+	void addActions(const RuleNative & other);
+
+	bool hasCondition(ConditionKind k) const { return conditionMask & (1u << k); }
+	bool hasAction(ActionKind k) const { return actionMask & (1u << k); }
+
+	// Sets an interval or bool condition as it is, without intersecting it with the old one.
+	void setValue(ConditionKind k, const ConditionSlot & slot);
+
 	bool hasTag(TagList t) const;
 	std::ostream & printSelf(std::ostream & os) const;
 	RuleNative * clone() const;
-	~RuleNative();
-	
+
+	// Rules are allocated from Arena<RuleNative>.
+	static void * operator new(size_t size);
+	static void operator delete(void * p, size_t size);
+
 	TagList tags;
-	
-	// There can be more than one of certain conditions (lists, socketGroups).
-	// We assume that there is at most one of others (interval, bool).
-	std::multimap<std::string, Condition *> conditions;
-	
+
+	// One bit per kind of condition and action the rule has.
+	unsigned conditionMask;
+	unsigned actionMask;
+
+	// Summary of the interval and bool conditions, kept up to date with their slots by setValue:
+	// one bit per bool condition which is true, and per condition which is Final or Override.
+	// Together with conditionMask, it answers most questions about containment and disjointness.
+	unsigned trueMask;
+	unsigned finalMask;
+	unsigned overrideMask;
+
+	// There can be more than one of certain conditions (lists, socketGroups), these are kept in lists,
+	// ordered by kind and then by the order they were added in.
+	// We assume that there is at most one of others (interval, bool), these have a slot each.
+	ConditionSlot conditions[CK_COUNT];
+	std::vector<ListCondition> lists;
+
 	// Only the last action of each type is preserved.
-	std::map<std::string, Action *> actions;
-	
+	ActionSlot actions[AK_COUNT];
+
 	// True if the rule does not match anything.
 	// In this case we do not guarantee that the list of conditions will be anything sensible.
 	bool useless;
+
+private:
+	void addValue(ConditionKind k, int from, int to, TagList t);
+	void addList(const ListCondition & c);
+	void addAction(ActionKind k, TagList t, int value, const SharedStrings & text);
 };
 
 bool RuleSubset(const RuleNative * small, const RuleNative * large);
 
+// True if both rules have equal actions (see ActionSlot), so that adding a modifier to either gives the same actions.
+bool SameActions(const RuleNative * first, const RuleNative * second);
+
+// True if adding the conditions of modifier to the rule surely makes it useless. Does not change or copy anything.
+bool RuleDisjoint(const RuleNative * rule, const RuleNative * modifier);
+
 typedef std::vector<RuleNative *> FilterNative;
 
+// A rule owned by a single place, while it is passed along the compiler.
+typedef std::unique_ptr<RuleNative> RulePtr;
+
 }
 
 #endif
\ No newline at end of file
@@ -2,26 +2,16 @@
 #define IFPP_RULE_OPERATIONS_H
 
 #include "Types.h"
-#include "Compiler.h"
+#include "RuleNative.h"
 
 namespace ifpp {
 
 /*
-Returns true if the first condition matches a subset of the second.
-Assumes both inputs are non-NULL.
-*/
-bool ConditionSubset(const Condition * first, const Condition * second);
-
-/*
-Returns a condition obtained as an intersection of two conditions.
-Assumes both inputs are non-NULL.
-
-Always returns a new condition.
-If the intersection doesn't match anything, returns NULL.
+Computes the intersection of two name lists of the same kind.
 
 For most conditions, adding them to a rule behaves like intersecting them.
 RuleNative is smart enough to trim conditions of the same type.
-So we do not need this function (and using it is treated as an internal error).
+So we do not need this for those.
 
 But we deal with Class and BaseType separately to avoid generating many useless rules.
 The assumption here is that the matching is done on the *input* strings, rather than all possible strings.
@@ -33,17 +23,17 @@ it leads to much fewer useless rules: consider a different style for every curre
 Note that we do not do this for HasExplicitMod, as it is quite reasonable for an item to match
 multiple such conditions simultaneously - when searching for an item with two or more different mods.
 
-Returns NULL if the intersection of the conditions is empty (according to the above rules).
+Returns an empty list if the intersection of the conditions is empty (according to the above rules).
 */
-Condition * ConditionIntersection(const Condition * first, const Condition * second);
+NameList NameListIntersection(const NameList & first, const NameList & second);
 
 /*
 Returns a rule obtained as an intersection of two rules.
-The intersection is always exact (but see above for intersecting NameLists).
+The intersection is always exact (but see above for intersecting Class and BaseType).
 
 Returns NULL if the two rules do not intersect at all.
 Returns first if the two rules potentially intersect, but the intersection does not need a separate rule.
-	This might be because first is Final, or because second does not override any action in first.
+	This might be because first is Final, or because second does not change any action in first.
 Returns a new rule otherwise.
 
 Conditions in the returned rule are an exact intersection of the two rules' conditions.
@@ -52,39 +42,42 @@ Actions are resolved according to the actions' modifiers.
 RuleNative * RuleIntersection(const RuleNative * first, const RuleNative * second);
 
 /*
-Computes a difference of the conditions first - second.
-If the first input is NULL, we assume there is no condition (i.e. matches everything).
+Computes a difference of the conditions first - second, of the same kind.
+If first is NULL, we assume there is no condition (i.e. matches everything).
 This lets us compute the complement of a condition.
 
-Output is:
-first:
+Interval conditions only take the values allowed for their kind (see getLimit),
+so the complement of ItemLevel >= 1 is empty, not ItemLevel < 1.
+
+Returns:
 	EMPTY if the difference is empty (matches nothing).
-	FIRST if the difference is exactly first.
-	NEW if the difference is a condition distinct from first.
+	FIRST if the difference is exactly first, or we can not tell anything better.
+	NEW if the difference is a condition distinct from first, which is stored in result.
 	INVALID if the difference is not a valid condition (e.g. not an interval for interval conditions).
-	
-second:	
-	If first is NEW, second is a new condition matching the interval.
-	Otherwise second is NULL.
+
+Only the values of the result are set, its tags are left alone.
 */
 enum DifferenceResult { EMPTY, FIRST, NEW, INVALID };
-std::pair<DifferenceResult, Condition *> ConditionDifference(const Condition * first, const Condition * second);
+DifferenceResult ConditionDifference(ConditionKind k, const ConditionSlot * first, const ConditionSlot & second, ConditionSlot & result);
+
+// The same for name lists and socket groups. Only name lists can give a NEW result.
+DifferenceResult ConditionDifference(const ListCondition * first, const ListCondition & second, NameList & result);
 
 /*
-Returns a rule obtained as the difference first - second.
+Narrows the first rule to the difference first - second.
 This can not always be computed exactly (conditions are not closed under complement).
-Thus we result an overestimate: (first - second) <= result <= first. (Subset relations.)
+Thus we keep an overestimate: (first - second) <= result <= first. (Subset relations.)
 
-Returns NULL if the difference is empty - the second condition matches everything the first does.
-Returns first if the result is first - either because the rules do not intersect, or because we can not give a better estimate.
-Returns a new rule otherwise.
+Marks the first rule useless if the difference is empty - the second rule matches everything the first does.
+Leaves the rule alone if the difference is all of first - either because the rules do not intersect,
+or because we can not give a better estimate.
+Otherwise changes or adds the one condition which makes up the difference. Its tags are kept.
 
-This should *not* ignore first if first is final.
-We use it to restrict the rule being added, which can be final.
-Actions in the new rule always copy actions in first.
+This does *not* ignore first if first is Final: only what the rules match matters, not their actions.
+Returns true if the first rule was changed.
 */
-RuleNative * RuleDifference(const RuleNative * first, const RuleNative * second);
-	
+bool RuleDifference(RuleNative & first, const RuleNative * second);
+
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,163 @@
+#include "Scheduler.h"
+
+namespace ifpp {
+
+// The scheduler and queue owned by the current thread, if it is a worker.
+static thread_local Scheduler * currentScheduler = NULL;
+static thread_local size_t currentQueue = 0;
+
+Scheduler::Scheduler(int threads) :
+	numThreads(threads > 1 ? threads : 1), queues(), workers(), queued(0), idleMutex(), idle(), stopping(false) {
+
+	for (int i = 0; i < numThreads; ++i) {
+		queues.emplace_back(new Queue());
+	}
+	for (int i = 1; i < numThreads; ++i) {
+		workers.emplace_back(&Scheduler::workerLoop, this, i);
+	}
+}
+
+Scheduler::~Scheduler() {
+	{
+		std::lock_guard<std::mutex> lock(idleMutex);
+		stopping = true;
+	}
+	idle.notify_all();
+	for (auto & w : workers) w.join();
+}
+
+void Scheduler::push(Task && task) {
+	size_t index = currentScheduler == this ? currentQueue : 0;
+	{
+		std::lock_guard<std::mutex> lock(queues[index]->mutex);
+		queues[index]->tasks.push_back(std::move(task));
+	}
+	++queued;
+	wake();
+}
+
+/*
+Workers take the newest task from their own queue first.
+Otherwise (and for outside threads) take the oldest task of the shared queue, then of the other workers.
+*/
+bool Scheduler::pop(Task & task) {
+	size_t own = currentScheduler == this ? currentQueue : 0;
+
+	if (own != 0) {
+		std::lock_guard<std::mutex> lock(queues[own]->mutex);
+		if (!queues[own]->tasks.empty()) {
+			task = std::move(queues[own]->tasks.back());
+			queues[own]->tasks.pop_back();
+			--queued;
+			return true;
+		}
+	}
+
+	for (size_t i = 0; i < queues.size(); ++i) {
+		size_t victim = (own + i) % queues.size();
+		if (victim == own && own != 0) continue;
+
+		std::lock_guard<std::mutex> lock(queues[victim]->mutex);
+		if (!queues[victim]->tasks.empty()) {
+			task = std::move(queues[victim]->tasks.front());
+			queues[victim]->tasks.pop_front();
+			--queued;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+bool Scheduler::runOne() {
+	Task task;
+	if (!pop(task)) return false;
+
+	std::exception_ptr e;
+	try {
+		task.run();
+	} catch (...) {
+		e = std::current_exception();
+	}
+	task.group->finished(e);
+	return true;
+}
+
+/*
+Everyone sleeping on the idle condition re-checks whatever they are waiting for.
+Locking the mutex first makes sure that nobody misses the notification between checking and sleeping.
+*/
+void Scheduler::wake() {
+	{
+		std::lock_guard<std::mutex> lock(idleMutex);
+	}
+	idle.notify_all();
+}
+
+void Scheduler::workerLoop(size_t index) {
+	currentScheduler = this;
+	currentQueue = index;
+
+	for (;;) {
+		if (runOne()) continue;
+
+		std::unique_lock<std::mutex> lock(idleMutex);
+		idle.wait(lock, [this]() { return stopping || queued > 0; });
+		if (stopping && queued == 0) return;
+	}
+}
+
+TaskGroup::~TaskGroup() {
+	try {
+		wait();
+	} catch (...) {
+		// Whoever owns the group did not call wait(), so they are not interested in errors.
+	}
+}
+
+void TaskGroup::spawn(std::function<void()> task) {
+	if (scheduler.numThreads == 1) {
+		try {
+			task();
+		} catch (...) {
+			finished(std::current_exception());
+		}
+		return;
+	}
+
+	++pending;
+	scheduler.push(Scheduler::Task(std::move(task), this));
+}
+
+void TaskGroup::wait() {
+	while (pending > 0) {
+		if (scheduler.runOne()) continue;
+
+		std::unique_lock<std::mutex> lock(scheduler.idleMutex);
+		scheduler.idle.wait(lock, [this]() { return pending == 0 || scheduler.queued > 0; });
+	}
+
+	std::exception_ptr e;
+	{
+		std::lock_guard<std::mutex> lock(errorMutex);
+		e = error;
+		error = NULL;
+	}
+	if (e) std::rethrow_exception(e);
+}
+
+void TaskGroup::finished(std::exception_ptr e) {
+	if (e) {
+		std::lock_guard<std::mutex> lock(errorMutex);
+		if (!error) error = e;
+	}
+
+	// Inline tasks (with a single thread) were never counted as pending.
+	if (scheduler.numThreads == 1) return;
+
+	// The group can be destroyed as soon as pending reaches zero, do not touch it afterwards.
+	Scheduler & s = scheduler;
+	if (--pending == 0) s.wake();
+}
+
+}
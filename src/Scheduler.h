@@ -0,0 +1,107 @@
+#ifndef IFPP_SCHEDULER_H
+#define IFPP_SCHEDULER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace ifpp {
+
+class TaskGroup;
+
+/*
+Work-stealing scheduler used to compile blocks in parallel.
+
+Every worker thread has its own queue of tasks. A worker runs the newest task from its own queue,
+which keeps the work depth-first, and when its queue is empty it steals the oldest task of another worker.
+The oldest tasks are the ones closest to the top of the block tree, and thus usually the biggest.
+Threads which do not belong to the scheduler put their tasks into a shared queue.
+
+A thread waiting for a task group does not block, it runs other tasks until the group is finished.
+This way tasks can spawn nested tasks and wait for them without running out of threads.
+*/
+class Scheduler {
+public:
+	// The thread waiting for tasks counts as one of the threads, so threads - 1 workers are started.
+	explicit Scheduler(int threads);
+	Scheduler(const Scheduler &) = delete;
+	Scheduler & operator=(const Scheduler &) = delete;
+	~Scheduler();
+
+	int threads() const { return numThreads; }
+
+private:
+	friend class TaskGroup;
+
+	struct Task {
+		Task() : run(), group(NULL) {}
+		Task(std::function<void()> r, TaskGroup * g) : run(std::move(r)), group(g) {}
+		Task(const Task &) = default;
+		Task(Task &&) = default;
+		Task & operator=(const Task &) = default;
+		Task & operator=(Task &&) = default;
+		std::function<void()> run;
+		TaskGroup * group;
+	};
+
+	struct Queue {
+		Queue() : mutex(), tasks() {}
+		std::mutex mutex;
+		std::deque<Task> tasks;
+	};
+
+	void push(Task && task);
+	bool pop(Task & task);
+	bool runOne();
+	void wake();
+	void workerLoop(size_t index);
+
+	int numThreads;
+
+	// Queue 0 is shared by threads outside of the scheduler, the others belong to one worker each.
+	std::vector<std::unique_ptr<Queue> > queues;
+	std::vector<std::thread> workers;
+
+	std::atomic<size_t> queued;
+	std::mutex idleMutex;
+	std::condition_variable idle;
+	bool stopping;
+};
+
+/*
+A set of tasks which can be waited for together.
+All tasks must be spawned by the same thread, which then calls wait().
+*/
+class TaskGroup {
+public:
+	explicit TaskGroup(Scheduler & s) : scheduler(s), pending(0), errorMutex(), error() {}
+	TaskGroup(const TaskGroup &) = delete;
+	TaskGroup & operator=(const TaskGroup &) = delete;
+	~TaskGroup();
+
+	// With a single thread the task is run right away, as if there was no scheduler.
+	void spawn(std::function<void()> task);
+
+	// Waits until all tasks are finished. Rethrows the first exception thrown by any of them.
+	void wait();
+
+private:
+	friend class Scheduler;
+
+	void finished(std::exception_ptr e);
+
+	Scheduler & scheduler;
+	std::atomic<size_t> pending;
+	std::mutex errorMutex;
+	std::exception_ptr error;
+};
+
+}
+
+#endif
\ No newline at end of file
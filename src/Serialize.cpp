@@ -0,0 +1,425 @@
+#include "Serialize.h"
+
+#include <memory>
+#include <stdexcept>
+
+namespace ifpp {
+
+// Type of every serialized command. Never renumber these, only add new ones (and increase the version).
+enum SerialCommand {
+	SC_INTERVAL = 1, SC_BOOL = 2, SC_NAMELIST = 3, SC_SOCKETGROUP = 4,
+	SC_NUMBER = 10, SC_COLOR = 11, SC_BOOLEAN = 12, SC_FILE = 13, SC_SOUND = 14, SC_EFFECT = 15, SC_MAPICON = 16, SC_REMOVE = 17,
+	SC_BLOCK = 20, SC_IGNORE = 21
+};
+
+// Nothing we write comes close to this, anything larger means the data is broken.
+static const unsigned long long SERIAL_MAX_LENGTH = 1 << 28;
+
+static void Malformed(const std::string & what) {
+	throw std::runtime_error("Malformed serialized data: " + what + ".");
+}
+
+/***********
+* WRITING
+***********/
+
+void SerialWriter::header(SerialKind kind) {
+	os.write("IFPP", 4);
+	os.put(static_cast<char>(kind));
+	writeUnsigned(SERIAL_VERSION);
+}
+
+void SerialWriter::writeUnsigned(unsigned long long x) {
+	while (x >= 0x80) {
+		os.put(static_cast<char>((x & 0x7F) | 0x80));
+		x >>= 7;
+	}
+	os.put(static_cast<char>(x));
+}
+
+void SerialWriter::writeSigned(long long x) {
+	// Zigzag encoding keeps small negative numbers small.
+	unsigned long long u = static_cast<unsigned long long>(x);
+	writeUnsigned(x < 0 ? ~(u << 1) : u << 1);
+}
+
+void SerialWriter::writeString(const std::string & s) {
+	writeUnsigned(s.size());
+	os.write(s.data(), s.size());
+}
+
+void SerialWriter::writeCommand(const Command * c) {
+	switch (c->comType) {
+		case COM_CONDITION: {
+			const auto con = static_cast<const Condition *>(c);
+			switch (con->conType) {
+				case CON_INTERVAL: {
+					const auto ci = static_cast<const ConditionInterval *>(con);
+					writeUnsigned(SC_INTERVAL);
+					writeSigned(ci->from);
+					writeSigned(ci->to);
+					break;
+				}
+				case CON_BOOL:
+					writeUnsigned(SC_BOOL);
+					writeUnsigned(static_cast<const ConditionBool *>(con)->value);
+					break;
+				case CON_NAMELIST: {
+					const auto & nl = static_cast<const ConditionNameList *>(con)->nameList->names();
+					writeUnsigned(SC_NAMELIST);
+					writeUnsigned(nl.size());
+					for (const auto & s : nl) writeString(s);
+					break;
+				}
+				case CON_SOCKETGROUP: {
+					const auto & sg = static_cast<const ConditionSocketGroup *>(con)->socketGroup;
+					writeUnsigned(SC_SOCKETGROUP);
+					writeSigned(sg.r);
+					writeSigned(sg.g);
+					writeSigned(sg.b);
+					writeSigned(sg.w);
+					break;
+				}
+				default:
+					throw UnhandledCase("Condition type", __FILE__, __LINE__);
+			}
+			break;
+		}
+
+		case COM_ACTION:
+			// Actions do not store their type, so find out the hard way.
+			if (const auto a = dynamic_cast<const ActionNumber *>(c)) {
+				writeUnsigned(SC_NUMBER);
+				writeSigned(a->arg1);
+			} else if (const auto a = dynamic_cast<const ActionColor *>(c)) {
+				writeUnsigned(SC_COLOR);
+				writeSigned(a->arg1.r);
+				writeSigned(a->arg1.g);
+				writeSigned(a->arg1.b);
+				writeSigned(a->arg1.a);
+			} else if (const auto a = dynamic_cast<const ActionBool *>(c)) {
+				writeUnsigned(SC_BOOLEAN);
+				writeUnsigned(a->arg1);
+			} else if (const auto a = dynamic_cast<const ActionFile *>(c)) {
+				writeUnsigned(SC_FILE);
+				writeString(a->arg1);
+			} else if (const auto a = dynamic_cast<const ActionSound *>(c)) {
+				writeUnsigned(SC_SOUND);
+				writeString(a->arg1);
+				writeSigned(a->arg2);
+			} else if (const auto a = dynamic_cast<const ActionEffect *>(c)) {
+				writeUnsigned(SC_EFFECT);
+				writeString(a->arg1);
+				writeString(a->arg2);
+			} else if (const auto a = dynamic_cast<const ActionMapIcon *>(c)) {
+				writeUnsigned(SC_MAPICON);
+				writeSigned(a->arg1);
+				writeString(a->arg2);
+				writeString(a->arg3);
+			} else if (dynamic_cast<const ActionRemove *>(c)) {
+				writeUnsigned(SC_REMOVE);
+			} else {
+				throw InternalError("Attempting to serialize an unknown action!", __FILE__, __LINE__);
+			}
+			break;
+
+		case COM_BLOCK: {
+			const auto b = static_cast<const Block *>(c);
+			writeUnsigned(SC_BLOCK);
+			writeUnsigned(b->blockType);
+			writeSigned(b->line);
+			writeUnsigned(b->commands.size());
+			for (const auto bc : b->commands) writeCommand(bc);
+			break;
+		}
+
+		case COM_IGNORE:
+			writeUnsigned(SC_IGNORE);
+			break;
+
+		default:
+			throw UnhandledCase("Command type", __FILE__, __LINE__);
+	}
+
+	// Common fields come last, so that the type is the first thing the reader sees.
+	// The kind only means something for conditions and actions.
+	unsigned kind = 0;
+	if (c->comType == COM_CONDITION) kind = static_cast<const Condition *>(c)->kind;
+	if (c->comType == COM_ACTION) kind = static_cast<const Action *>(c)->kind;
+	writeUnsigned(kind);
+	writeUnsigned(c->tags);
+}
+
+void SerialWriter::writeRule(const RuleNative * r) {
+	writeUnsigned(r->tags);
+	writeUnsigned(r->useless);
+
+	// The slots present, in order of their kind.
+	writeUnsigned(r->conditionMask);
+	for (int k = 0; k < CK_COUNT; ++k) {
+		const ConditionType type = ConditionKindType(static_cast<ConditionKind>(k));
+		if (!r->hasCondition(static_cast<ConditionKind>(k)) || type == CON_NAMELIST || type == CON_SOCKETGROUP) continue;
+		writeSigned(r->conditions[k].from);
+		writeSigned(r->conditions[k].to);
+		writeUnsigned(r->conditions[k].tags);
+	}
+
+	writeUnsigned(r->lists.size());
+	for (const auto & c : r->lists) {
+		writeUnsigned(c.kind);
+		writeUnsigned(c.tags);
+		writeUnsigned(c.sockets);
+		if (c.names.empty()) {
+			writeUnsigned(0);
+		} else {
+			writeUnsigned(c.names->names().size());
+			for (const auto & s : c.names->names()) writeString(s);
+		}
+	}
+
+	writeUnsigned(r->actionMask);
+	for (int k = 0; k < AK_COUNT; ++k) {
+		if (!r->hasAction(static_cast<ActionKind>(k))) continue;
+		const ActionSlot & slot = r->actions[k];
+		writeUnsigned(slot.tags);
+		writeSigned(slot.value);
+		writeUnsigned(!slot.text.empty());
+		if (!slot.text.empty()) {
+			writeString((*slot.text)[0]);
+			writeString((*slot.text)[1]);
+		}
+	}
+}
+
+/***********
+* READING
+***********/
+
+void SerialReader::header(SerialKind kind) {
+	char magic[4];
+	if (!is.read(magic, 4) || std::string(magic, 4) != "IFPP") Malformed("missing header");
+	if (readByte() != static_cast<unsigned char>(kind)) Malformed("unexpected kind of data");
+	if (readUnsigned() != SERIAL_VERSION) {
+		throw std::runtime_error("Serialized data has a different version, was it written by a different version of IFPP?");
+	}
+}
+
+unsigned char SerialReader::readByte() {
+	int c = is.get();
+	if (c == std::char_traits<char>::eof()) Malformed("unexpected end of data");
+	return static_cast<unsigned char>(c);
+}
+
+unsigned long long SerialReader::readUnsigned() {
+	unsigned long long x = 0;
+	for (int shift = 0; shift < 64; shift += 7) {
+		unsigned char b = readByte();
+		x |= static_cast<unsigned long long>(b & 0x7F) << shift;
+		if (!(b & 0x80)) return x;
+	}
+	Malformed("number too long");
+	return 0;
+}
+
+long long SerialReader::readSigned() {
+	unsigned long long u = readUnsigned();
+	return static_cast<long long>(u & 1 ? ~(u >> 1) : u >> 1);
+}
+
+int SerialReader::readInt() {
+	long long x = readSigned();
+	if (x < INT_MIN || x > INT_MAX) Malformed("number out of range");
+	return static_cast<int>(x);
+}
+
+std::string SerialReader::readString() {
+	unsigned long long length = readUnsigned();
+	if (length > SERIAL_MAX_LENGTH) Malformed("string too long");
+	std::string s(length, '\0');
+	if (length > 0 && !is.read(&s[0], length)) Malformed("unexpected end of data");
+	return s;
+}
+
+Command * SerialReader::readCommand() {
+	unsigned long long type = readUnsigned();
+
+	// The common fields come after the specific ones, so gather those first.
+	int i1 = 0, i2 = 0, i3 = 0, i4 = 0;
+	std::string s1, s2;
+	NameList nl;
+	std::unique_ptr<Block> block;
+
+	switch (type) {
+		case SC_INTERVAL:
+			i1 = readInt();
+			i2 = readInt();
+			break;
+		case SC_BOOL:
+		case SC_BOOLEAN:
+			i1 = readUnsigned() != 0;
+			break;
+		case SC_NAMELIST: {
+			unsigned long long size = readUnsigned();
+			if (size > SERIAL_MAX_LENGTH) Malformed("list too long");
+			for (unsigned long long i = 0; i < size; ++i) nl.push_back(readString());
+			break;
+		}
+		case SC_SOCKETGROUP:
+		case SC_COLOR:
+			i1 = readInt();
+			i2 = readInt();
+			i3 = readInt();
+			i4 = readInt();
+			break;
+		case SC_NUMBER:
+			i1 = readInt();
+			break;
+		case SC_FILE:
+			s1 = readString();
+			break;
+		case SC_SOUND:
+			s1 = readString();
+			i1 = readInt();
+			break;
+		case SC_EFFECT:
+			s1 = readString();
+			s2 = readString();
+			break;
+		case SC_MAPICON:
+			i1 = readInt();
+			s1 = readString();
+			s2 = readString();
+			break;
+		case SC_REMOVE:
+		case SC_IGNORE:
+			break;
+		case SC_BLOCK: {
+			unsigned long long blockType = readUnsigned();
+			if (blockType > BLOCK_DEFAULT) Malformed("unknown block type");
+			block.reset(new Block(static_cast<BlockType>(blockType)));
+			block->line = readInt();
+			unsigned long long size = readUnsigned();
+			if (size > SERIAL_MAX_LENGTH) Malformed("block too long");
+			for (unsigned long long i = 0; i < size; ++i) block->commands.push_back(readCommand());
+			break;
+		}
+		default:
+			Malformed("unknown command type");
+	}
+
+	unsigned long long kind = readUnsigned();
+	TagList tags = static_cast<TagList>(readUnsigned());
+
+	// The kind of a condition must also have the type of the condition.
+	auto condition = [kind](ConditionType ct) {
+		if (kind >= CK_COUNT || ConditionKindType(static_cast<ConditionKind>(kind)) != ct) Malformed("unknown condition");
+		return static_cast<ConditionKind>(kind);
+	};
+	auto action = [kind]() {
+		if (kind >= AK_COUNT) Malformed("unknown action");
+		return static_cast<ActionKind>(kind);
+	};
+
+	switch (type) {
+		case SC_INTERVAL: return new ConditionInterval(condition(CON_INTERVAL), i1, i2, tags);
+		case SC_BOOL: return new ConditionBool(condition(CON_BOOL), i1, tags);
+		case SC_NAMELIST: return new ConditionNameList(condition(CON_NAMELIST), SharedNames(nl), tags);
+		case SC_SOCKETGROUP: {
+			SocketGroup sg;
+			sg.r = i1;
+			sg.g = i2;
+			sg.b = i3;
+			sg.w = i4;
+			return new ConditionSocketGroup(condition(CON_SOCKETGROUP), sg, tags);
+		}
+		case SC_NUMBER: return new ActionNumber(action(), i1, tags);
+		case SC_COLOR: return new ActionColor(action(), Color(i1, i2, i3, i4), tags);
+		case SC_BOOLEAN: return new ActionBool(action(), i1, tags);
+		case SC_FILE: return new ActionFile(action(), s1, tags);
+		case SC_SOUND: return new ActionSound(action(), s1, i1, tags);
+		case SC_EFFECT: return new ActionEffect(action(), s1, s2, tags);
+		case SC_MAPICON: return new ActionMapIcon(action(), i1, s1, s2, tags);
+		case SC_REMOVE: return new ActionRemove(action(), tags);
+		case SC_IGNORE: return new Ignore(tags);
+		case SC_BLOCK: {
+			auto b = new Block(block->blockType, tags, block->line);
+			b->commands.swap(block->commands);
+			return b;
+		}
+		default:
+			throw UnhandledCase("Serialized command type", __FILE__, __LINE__);
+	}
+}
+
+RuleNative * SerialReader::readRule() {
+	std::unique_ptr<RuleNative> r(new RuleNative(static_cast<TagList>(readUnsigned())));
+	r->useless = readUnsigned() != 0;
+
+	unsigned long long mask = readUnsigned();
+	if (mask >> CK_COUNT) Malformed("unknown condition");
+	r->conditionMask = static_cast<unsigned>(mask);
+	for (int k = 0; k < CK_COUNT; ++k) {
+		const ConditionType type = ConditionKindType(static_cast<ConditionKind>(k));
+		if (!r->hasCondition(static_cast<ConditionKind>(k)) || type == CON_NAMELIST || type == CON_SOCKETGROUP) continue;
+		ConditionSlot slot;
+		slot.from = readInt();
+		slot.to = readInt();
+		slot.tags = static_cast<TagList>(readUnsigned());
+		r->setValue(static_cast<ConditionKind>(k), slot);
+	}
+
+	// The lists must be ordered by kind, and there must be a list for every kind in the mask.
+	unsigned listMask = 0;
+	unsigned long long size = readUnsigned();
+	if (size > SERIAL_MAX_LENGTH) Malformed("rule too long");
+	for (unsigned long long i = 0; i < size; ++i) {
+		unsigned long long kind = readUnsigned();
+		if (kind >= CK_COUNT) Malformed("unknown condition");
+		const ConditionType type = ConditionKindType(static_cast<ConditionKind>(kind));
+		if (type != CON_NAMELIST && type != CON_SOCKETGROUP) Malformed("expected a list condition");
+		if (!r->lists.empty() && r->lists.back().kind > kind) Malformed("list conditions out of order");
+
+		ListCondition c{static_cast<ConditionKind>(kind), static_cast<TagList>(readUnsigned()), 0, SharedNames()};
+		c.sockets = static_cast<unsigned>(readUnsigned());
+		unsigned long long names = readUnsigned();
+		if (names > SERIAL_MAX_LENGTH) Malformed("list too long");
+		if (type == CON_NAMELIST) {
+			NameList nl;
+			for (unsigned long long j = 0; j < names; ++j) nl.push_back(readString());
+			c.names = SharedNames(nl);
+		} else if (names != 0) {
+			Malformed("socket group with names");
+		}
+		r->lists.push_back(c);
+		listMask |= 1u << kind;
+	}
+	for (int k = 0; k < CK_COUNT; ++k) {
+		const ConditionType type = ConditionKindType(static_cast<ConditionKind>(k));
+		if ((type == CON_NAMELIST || type == CON_SOCKETGROUP) && r->hasCondition(static_cast<ConditionKind>(k)) != ((listMask >> k) & 1)) {
+			Malformed("list conditions do not match the rule");
+		}
+	}
+
+	mask = readUnsigned();
+	if (mask >> AK_COUNT) Malformed("unknown action");
+	r->actionMask = static_cast<unsigned>(mask);
+	for (int k = 0; k < AK_COUNT; ++k) {
+		if (!r->hasAction(static_cast<ActionKind>(k))) continue;
+		ActionSlot & slot = r->actions[k];
+		slot.tags = static_cast<TagList>(readUnsigned());
+		slot.value = readInt();
+		if (readUnsigned() != 0) {
+			NameList text;
+			text.push_back(readString());
+			text.push_back(readString());
+			slot.text = SharedStrings(text);
+		}
+		if (ActionKindHasText(static_cast<ActionKind>(k)) != !slot.text.empty() && !(slot.tags & TAG_REMOVE)) {
+			Malformed("action does not match its kind");
+		}
+	}
+
+	return r.release();
+}
+
+}
@@ -0,0 +1,68 @@
+#ifndef IFPP_SERIALIZE_H
+#define IFPP_SERIALIZE_H
+
+#include "Types.h"
+#include "RuleNative.h"
+
+#include <istream>
+#include <ostream>
+#include <string>
+
+namespace ifpp {
+
+/*
+Compact binary format for passing blocks and native rules between processes.
+
+Every stream starts with a header: the bytes "IFPP", one byte for the kind of data and the format version.
+Numbers are stored as variable-length integers (7 bits per byte, signed numbers zigzag encoded),
+strings as their length followed by the characters. Commands and rules are stored field by field,
+every command starts with a byte identifying its type. Conditions and actions store their kind, not their name.
+Rules are stored slot by slot, see RuleNative.
+
+The version must be increased whenever the encoding of anything changes.
+A reader refuses data of a different version, and data which ends early or does not make sense.
+*/
+const unsigned int SERIAL_VERSION = 4;
+
+enum SerialKind { SERIAL_SHARD = 'S', SERIAL_RESULT = 'R', SERIAL_RUN = 'U' };
+
+class SerialWriter {
+public:
+	explicit SerialWriter(std::ostream & o) : os(o) {}
+
+	void header(SerialKind kind);
+	void writeUnsigned(unsigned long long x);
+	void writeSigned(long long x);
+	void writeString(const std::string & s);
+
+	void writeCommand(const Command * c);
+	void writeRule(const RuleNative * r);
+
+private:
+	std::ostream & os;
+};
+
+class SerialReader {
+public:
+	explicit SerialReader(std::istream & i) : is(i) {}
+
+	// Throws std::runtime_error if the header is not of the given kind and the current version.
+	void header(SerialKind kind);
+	unsigned long long readUnsigned();
+	long long readSigned();
+	int readInt();
+	std::string readString();
+
+	// The caller owns the returned objects.
+	Command * readCommand();
+	RuleNative * readRule();
+
+private:
+	unsigned char readByte();
+
+	std::istream & is;
+};
+
+}
+
+#endif
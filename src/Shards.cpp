@@ -0,0 +1,274 @@
+#include "Shards.h"
+#include "Scheduler.h"
+#include "Serialize.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#define popen _popen
+#define pclose _pclose
+static const char * PIPE_MODE = "rb";
+#else
+static const char * PIPE_MODE = "r";
+#endif
+
+namespace ifpp {
+
+// Status of a worker, written right after the header of the result.
+enum WorkerStatus { WORKER_OK = 0, WORKER_FAILED = 1, WORKER_CANCELLED = 2 };
+
+struct ShardResult {
+	ShardResult() : ok(false), cancelled(false), failure(), blockFilters(), messages(), numWarnings(0), numErrors(0), numCritical(0) {}
+
+	bool ok;
+	bool cancelled; // The worker was interrupted, this is not a failure to recover from.
+	std::string failure;
+
+	std::vector<FilterNative> blockFilters;
+	std::string messages;
+	int numWarnings, numErrors, numCritical;
+};
+
+static void DeleteFilters(std::vector<FilterNative> & filters) {
+	for (auto & f : filters) {
+		for (const auto r : f) delete r;
+		f.clear();
+	}
+}
+
+/*
+Starts a worker on the shard file and reads its whole output.
+Any failure is recorded in the result instead of thrown, the caller falls back to compiling the shard itself.
+*/
+static void RunShard(ShardResult & result, const std::string & command, const std::string & shardFile) {
+	std::string cmd = command + " --worker \"" + shardFile + "\"";
+	FILE * pipe = popen(cmd.c_str(), PIPE_MODE);
+	if (!pipe) {
+		result.failure = "could not start the worker";
+		return;
+	}
+
+	std::string data;
+	char buffer[1 << 16];
+	size_t n;
+	while ((n = fread(buffer, 1, sizeof(buffer), pipe)) > 0) data.append(buffer, n);
+	int status = pclose(pipe);
+
+	try {
+		std::istringstream is(data);
+		SerialReader reader(is);
+		reader.header(SERIAL_RESULT);
+
+		const size_t workerStatus = reader.readUnsigned();
+		if (workerStatus != WORKER_OK) {
+			result.cancelled = workerStatus == WORKER_CANCELLED;
+			result.failure = reader.readString();
+			return;
+		}
+
+		size_t numBlocks = reader.readUnsigned();
+		result.blockFilters.resize(numBlocks);
+		for (auto & f : result.blockFilters) {
+			size_t numRules = reader.readUnsigned();
+			for (size_t i = 0; i < numRules; ++i) f.push_back(reader.readRule());
+		}
+
+		result.messages = reader.readString();
+		result.numWarnings = reader.readInt();
+		result.numErrors = reader.readInt();
+		result.numCritical = reader.readInt();
+	} catch (std::exception & e) {
+		DeleteFilters(result.blockFilters);
+		result.failure = status != 0 ? "the worker crashed" : e.what();
+		return;
+	}
+
+	if (status != 0) {
+		DeleteFilters(result.blockFilters);
+		result.failure = "the worker exited with an error";
+		return;
+	}
+
+	result.ok = true;
+}
+
+void CompileSharded(FilterNative & outFilter, const FilterIFPP & inFilter,
+	Logger & log, const CompilerOptions & options, const ShardOptions & shards) {
+
+	for (const auto r : outFilter) delete r;
+	outFilter.clear();
+
+	auto blocks = TopLevelBlocks(inFilter);
+
+	// The limits are checked once for the whole filter, the workers do not need to.
+	Compiler c(log, options);
+	c.CheckLimits(blocks);
+	if (blocks.empty()) return;
+
+	CompilerOptions workerOptions(options);
+	workerOptions.threads = 1;
+	workerOptions.maxRules = 0;
+	workerOptions.maxBlockRules = 0;
+
+	size_t numShards = std::min(static_cast<size_t>(shards.workers > 0 ? shards.workers : 1), blocks.size());
+	std::vector<size_t> shardStart(numShards + 1);
+	std::vector<std::string> shardFiles(numShards);
+	for (size_t k = 0; k <= numShards; ++k) shardStart[k] = k * blocks.size() / numShards;
+
+	// Write the shard files.
+	for (size_t k = 0; k < numShards; ++k) {
+		std::stringstream ss;
+		ss << shards.tempBase << ".shard" << k;
+		shardFiles[k] = ss.str();
+
+		std::ofstream os(shardFiles[k], std::ios_base::out | std::ios_base::binary);
+		SerialWriter writer(os);
+		writer.header(SERIAL_SHARD);
+		writer.writeUnsigned(workerOptions.warnRules);
+		writer.writeUnsigned(shardStart[k + 1] - shardStart[k]);
+		for (size_t i = shardStart[k]; i < shardStart[k + 1]; ++i) writer.writeCommand(blocks[i]);
+		os.close();
+		if (!os) throw std::runtime_error("Unable to write shard file \"" + shardFiles[k] + "\"!");
+	}
+
+	// Run the workers. Every thread only waits for its worker process.
+	std::vector<ShardResult> results(numShards);
+	std::vector<std::thread> threads;
+	for (size_t k = 0; k < numShards; ++k) {
+		threads.emplace_back(RunShard, std::ref(results[k]), std::cref(shards.workerCommand), std::cref(shardFiles[k]));
+	}
+	for (auto & t : threads) t.join();
+
+	for (const auto & f : shardFiles) std::remove(f.c_str());
+
+	// Ctrl+C also reaches the workers, which either stop on their own or are killed by it.
+	// Either way the whole compilation is cancelled, there is nothing to recompile.
+	bool cancelled = options.cancel && options.cancel->cancelled();
+	for (const auto & result : results) {
+		if (result.cancelled) cancelled = true;
+	}
+	if (cancelled) {
+		for (auto & result : results) DeleteFilters(result.blockFilters);
+		throw CompileCancelled();
+	}
+
+	// Merge the results in order, compiling the shards of failed workers here.
+	std::unique_ptr<Scheduler> scheduler;
+	try {
+		for (size_t k = 0; k < numShards; ++k) {
+			auto & result = results[k];
+			size_t numBlocks = shardStart[k + 1] - shardStart[k];
+
+			if (result.ok && result.blockFilters.size() != numBlocks) {
+				DeleteFilters(result.blockFilters);
+				result.ok = false;
+				result.failure = "the worker returned a wrong number of blocks";
+			}
+
+			if (result.ok) {
+				log.message() << result.messages;
+				log.numWarnings += result.numWarnings;
+				log.numErrors += result.numErrors;
+				log.numCritical += result.numCritical;
+			} else {
+				log.warning() << "Worker for shard " << k << " failed: " << result.failure
+					<< ". Compiling the shard in the main process." << std::endl;
+				if (!scheduler) scheduler.reset(new Scheduler(options.threads));
+				result.blockFilters.resize(numBlocks);
+				for (size_t i = 0; i < numBlocks; ++i) {
+					c.Compile(result.blockFilters[i], blocks[shardStart[k] + i], *scheduler);
+				}
+			}
+
+			for (auto & f : result.blockFilters) {
+				outFilter.insert(outFilter.end(), f.begin(), f.end());
+				f.clear();
+			}
+		}
+	} catch (...) {
+		for (auto & result : results) DeleteFilters(result.blockFilters);
+		throw;
+	}
+}
+
+int RunWorker(const std::string & shardFile, std::ostream & out, const CancelToken * cancel) {
+	SerialWriter writer(out);
+	writer.header(SERIAL_RESULT);
+
+	std::vector<Block *> blocks;
+	std::vector<FilterNative> blockFilters;
+	std::stringstream messages;
+	Logger log(messages);
+
+	try {
+		std::ifstream is(shardFile, std::ios_base::in | std::ios_base::binary);
+		if (!is.is_open()) throw std::runtime_error("Unable to open shard file \"" + shardFile + "\"!");
+
+		SerialReader reader(is);
+		reader.header(SERIAL_SHARD);
+
+		CompilerOptions options;
+		options.warnRules = reader.readUnsigned() != 0;
+		options.cancel = cancel;
+
+		size_t numBlocks = reader.readUnsigned();
+		for (size_t i = 0; i < numBlocks; ++i) {
+			Command * c = reader.readCommand();
+			if (c->comType != COM_BLOCK) {
+				delete c;
+				throw std::runtime_error("Shard file contains something else than blocks!");
+			}
+			blocks.push_back(static_cast<Block *>(c));
+		}
+
+		Compiler compiler(log, options);
+		Scheduler scheduler(options.threads);
+		blockFilters.resize(blocks.size());
+		for (size_t i = 0; i < blocks.size(); ++i) {
+			compiler.Compile(blockFilters[i], blocks[i], scheduler);
+		}
+	} catch (CompileCancelled & e) {
+		for (const auto b : blocks) delete b;
+		DeleteFilters(blockFilters);
+		writer.writeUnsigned(WORKER_CANCELLED);
+		writer.writeString(e.what());
+		out.flush();
+		return EXIT_FAILURE;
+	} catch (std::exception & e) {
+		for (const auto b : blocks) delete b;
+		DeleteFilters(blockFilters);
+		writer.writeUnsigned(WORKER_FAILED);
+		writer.writeString(e.what());
+		out.flush();
+		return EXIT_FAILURE;
+	}
+
+	writer.writeUnsigned(WORKER_OK);
+	writer.writeUnsigned(blockFilters.size());
+	for (const auto & f : blockFilters) {
+		writer.writeUnsigned(f.size());
+		for (const auto r : f) writer.writeRule(r);
+	}
+	writer.writeString(messages.str());
+	writer.writeSigned(log.numWarnings);
+	writer.writeSigned(log.numErrors);
+	writer.writeSigned(log.numCritical);
+	out.flush();
+
+	for (const auto b : blocks) delete b;
+	DeleteFilters(blockFilters);
+
+	return out ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+}
@@ -0,0 +1,47 @@
+#ifndef IFPP_SHARDS_H
+#define IFPP_SHARDS_H
+
+#include "Types.h"
+#include "RuleNative.h"
+#include "Logger.h"
+#include "Compiler.h"
+
+#include <ostream>
+#include <string>
+
+namespace ifpp {
+
+struct ShardOptions {
+	ShardOptions() : workers(0), workerCommand(), tempBase() {}
+
+	// Number of worker processes. 0 compiles everything in this process.
+	int workers;
+
+	// Command starting a worker, the shard file is appended as "--worker <file>".
+	std::string workerCommand;
+
+	// Shards are passed to the workers in files named tempBase.shard<N>, removed afterwards.
+	std::string tempBase;
+};
+
+/*
+Compiles a filter by splitting its top-level blocks into shards and compiling every shard in a worker process.
+The rules of the shards are merged in the order of the blocks, so the result is the same as from Compiler::Compile.
+
+Variables are resolved by the parser, so the blocks are all a worker needs.
+If a worker fails for any reason (crash, bad output), its shard is compiled in this process instead.
+Unless the compilation was cancelled: then the workers are interrupted as well, and CompileCancelled is thrown.
+*/
+void CompileSharded(FilterNative & outFilter, const FilterIFPP & inFilter,
+	Logger & log, const CompilerOptions & options, const ShardOptions & shards);
+
+/*
+The worker side: compiles the blocks in the shard file and writes the rules, and the messages of the compiler, to out.
+A cancelled worker reports so to the coordinator, which then cancels the whole compilation.
+Returns the exit code of the worker.
+*/
+int RunWorker(const std::string & shardFile, std::ostream & out, const CancelToken * cancel = NULL);
+
+}
+
+#endif
@@ -0,0 +1,116 @@
+#ifndef IFPP_SHARED_H
+#define IFPP_SHARED_H
+
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+
+namespace ifpp {
+
+/*
+Hash-consed immutable values.
+There is one node for every distinct value, shared by reference count by all handles holding that value,
+so copying a handle never copies the value, and two handles are equal exactly if they point to the same node.
+
+Nodes are created by the constructor taking a value, which looks the value up in a pool (one per type).
+Nodes nobody holds any more are freed by the pool, whenever it has doubled in size since the last time it did that.
+Handles can be used from any thread.
+
+Values are looked up by key, which is the value itself unless given: T must then be constructible from Key and comparable to it.
+Hash must be a function object hashing Key.
+*/
+template<class T, class Hash, class Key = T>
+class Shared {
+public:
+	Shared() : node(NULL) {}
+	explicit Shared(const Key & key) : node(Pool::instance().intern(key)) {}
+	Shared(const Shared & other) : node(other.node) { if (node) ++node->refs; }
+	Shared(Shared && other) : node(other.node) { other.node = NULL; }
+	Shared & operator=(Shared other) { std::swap(node, other.node); return *this; }
+	~Shared() { if (node) --node->refs; }
+
+	bool empty() const { return !node; }
+	const T & operator*() const { return node->value; }
+	const T * operator->() const { return &node->value; }
+
+	bool operator==(const Shared & other) const { return node == other.node; }
+	bool operator!=(const Shared & other) const { return node != other.node; }
+
+	// Number of distinct values currently in the pool, for statistics.
+	static size_t poolSize() { return Pool::instance().size(); }
+
+private:
+	struct Node {
+		Node(const Key & k, size_t h) : value(k), hash(h), refs(1) {}
+		const T value;
+		const size_t hash;
+		std::atomic<unsigned> refs;
+	};
+
+	class Pool {
+	public:
+		static Pool & instance() {
+			static Pool pool;
+			return pool;
+		}
+
+		Node * intern(const Key & key) {
+			const size_t hash = Hash()(key);
+			std::lock_guard<std::mutex> lock(mutex);
+
+			auto range = nodes.equal_range(hash);
+			for (auto it = range.first; it != range.second; ++it) {
+				if (it->second->value == key) {
+					// A node nobody holds can only be freed while the lock is held, so it is safe to revive it.
+					++it->second->refs;
+					return it->second;
+				}
+			}
+
+			if (nodes.size() >= 2 * collected) collect();
+			Node * node = new Node(key, hash);
+			nodes.insert(std::make_pair(hash, node));
+			return node;
+		}
+
+		size_t size() {
+			std::lock_guard<std::mutex> lock(mutex);
+			return nodes.size();
+		}
+
+		~Pool() {
+			for (auto & n : nodes) delete n.second;
+		}
+
+	private:
+		Pool() : mutex(), nodes(), collected(64) {}
+		Pool(const Pool &) = delete;
+		Pool & operator=(const Pool &) = delete;
+
+		// Frees the nodes nobody holds. New handles to them can only be made by intern, which holds the lock.
+		void collect() {
+			for (auto it = nodes.begin(); it != nodes.end(); ) {
+				if (it->second->refs == 0) {
+					delete it->second;
+					it = nodes.erase(it);
+				} else {
+					++it;
+				}
+			}
+			collected = nodes.size() > 64 ? nodes.size() : 64;
+		}
+
+		std::mutex mutex;
+		std::unordered_multimap<size_t, Node *> nodes;
+		size_t collected;
+	};
+
+	Node * node;
+};
+
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,252 @@
+#include "Spill.h"
+#include "Serialize.h"
+
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+namespace ifpp {
+
+std::string SpillManager::newFile() {
+	std::stringstream ss;
+	ss << fileBase << ".spill" << nextFile++;
+	return ss.str();
+}
+
+// Deletes the rules of a chunk, taken rules are NULL.
+static void DeleteRules(FilterNative & rules) {
+	for (const auto r : rules) delete r;
+	rules.clear();
+}
+
+size_t RuleMemory(const RuleNative * r) {
+	// The slots are part of the rule. Name lists and strings of actions are shared by all rules, so they are not counted.
+	return sizeof(RuleNative) + r->lists.capacity() * sizeof(ListCondition);
+}
+
+RuleRun::RuleRun(RuleRun && other) :
+	parts(std::move(other.parts)), spill(other.spill), numRules(other.numRules), numUseful(other.numUseful) {
+
+	other.parts.clear();
+	other.numRules = 0;
+	other.numUseful = 0;
+}
+
+/*
+The part new rules go to: the last one, unless that one has been spilled already.
+*/
+RuleRun::Part & RuleRun::tail() {
+	if (parts.empty() || !parts.back().file.empty()) parts.push_back(Part());
+	return parts.back();
+}
+
+void RuleRun::push(RuleNative * r) {
+	Part & t = tail();
+	t.rules.push_back(r);
+	++t.count;
+	++numRules;
+	if (!r->useless) ++numUseful;
+
+	if (spill) {
+		size_t memory = RuleMemory(r);
+		t.memory += memory;
+		if (spill->reserve(memory) && t.memory >= spill->minSpill()) spillTail();
+	}
+}
+
+void RuleRun::append(FilterNative & rules) {
+	for (const auto r : rules) push(r);
+	rules.clear();
+}
+
+/*
+Takes over all parts of the other run. Parts in memory are merged, so appending many small runs does not fragment it.
+*/
+void RuleRun::append(RuleRun & other) {
+	if (other.spill != spill) {
+		throw InternalError("Attempting to append runs with different spill managers!", __FILE__, __LINE__);
+	}
+
+	for (auto & part : other.parts) {
+		if (part.file.empty() && !parts.empty() && parts.back().file.empty()) {
+			Part & t = parts.back();
+			t.rules.insert(t.rules.end(), part.rules.begin(), part.rules.end());
+			t.count += part.count;
+			t.memory += part.memory;
+		} else {
+			parts.push_back(std::move(part));
+		}
+	}
+	numRules += other.numRules;
+	numUseful += other.numUseful;
+
+	other.parts.clear();
+	other.numRules = 0;
+	other.numUseful = 0;
+
+	if (spill && !parts.empty() && parts.back().file.empty()
+		&& spill->reserve(0) && parts.back().memory >= spill->minSpill()) {
+		spillTail();
+	}
+}
+
+void RuleRun::writeFile(const std::string & file, const FilterNative & rules) const {
+	std::ofstream os(file, std::ios_base::out | std::ios_base::binary);
+	SerialWriter writer(os);
+	writer.header(SERIAL_RUN);
+	for (const auto r : rules) writer.writeRule(r);
+	os.close();
+	if (!os) {
+		std::remove(file.c_str());
+		throw std::runtime_error("Unable to write spill file \"" + file + "\"!");
+	}
+}
+
+/*
+Writes the rules of the last part to a file and deletes them.
+*/
+void RuleRun::spillTail() {
+	Part & t = parts.back();
+	std::string file = spill->newFile();
+	writeFile(file, t.rules);
+
+	for (const auto r : t.rules) delete r;
+	FilterNative().swap(t.rules);
+	spill->release(t.memory);
+	t.memory = 0;
+	t.file = file;
+}
+
+/*
+Reads back the rules of a spilled part, a chunk at a time. The chunks belong to f, also if it throws.
+*/
+void RuleRun::readFile(const Part & part, const std::function<void(FilterNative & chunk)> & f) const {
+	std::ifstream is(part.file, std::ios_base::in | std::ios_base::binary);
+	if (!is.is_open()) throw std::runtime_error("Unable to read spill file \"" + part.file + "\"!");
+
+	SerialReader reader(is);
+	reader.header(SERIAL_RUN);
+
+	size_t remaining = part.count;
+	while (remaining > 0) {
+		FilterNative chunk;
+		size_t memory = 0;
+		try {
+			while (remaining > 0 && memory < spill->chunkBytes()) {
+				chunk.push_back(reader.readRule());
+				memory += RuleMemory(chunk.back());
+				--remaining;
+			}
+		} catch (...) {
+			DeleteRules(chunk);
+			throw;
+		}
+		f(chunk);
+	}
+}
+
+void RuleRun::consume(const std::function<void(FilterNative & chunk)> & f) {
+	// Whatever f leaves in the chunk is deleted, also if it throws halfway through.
+	auto taken = [&f](FilterNative & chunk) {
+		try {
+			f(chunk);
+		} catch (...) {
+			DeleteRules(chunk);
+			throw;
+		}
+		DeleteRules(chunk);
+	};
+
+	for (auto & part : parts) {
+		if (part.file.empty()) {
+			// Take the rules out of the part first, so that an exception does not leave them to be deleted twice.
+			FilterNative chunk;
+			chunk.swap(part.rules);
+			if (spill) spill->release(part.memory);
+			part.memory = 0;
+			taken(chunk);
+		} else {
+			readFile(part, taken);
+			std::remove(part.file.c_str());
+			part.file.clear();
+		}
+	}
+
+	parts.clear();
+	numRules = 0;
+	numUseful = 0;
+}
+
+void RuleRun::update(const std::function<void(FilterNative & chunk)> & f) {
+	numUseful = 0;
+	auto count = [this](const FilterNative & chunk) {
+		for (const auto r : chunk) {
+			if (!r->useless) ++numUseful;
+		}
+	};
+
+	for (auto & part : parts) {
+		if (part.file.empty()) {
+			f(part.rules);
+			count(part.rules);
+		} else {
+			// The rules are read back and written to a new file chunk by chunk, as they do not fit in memory together.
+			std::string file = spill->newFile();
+			std::ofstream os(file, std::ios_base::out | std::ios_base::binary);
+			SerialWriter writer(os);
+			writer.header(SERIAL_RUN);
+
+			try {
+				readFile(part, [&](FilterNative & chunk) {
+					try {
+						f(chunk);
+						count(chunk);
+						for (const auto r : chunk) writer.writeRule(r);
+					} catch (...) {
+						DeleteRules(chunk);
+						throw;
+					}
+					DeleteRules(chunk);
+				});
+			} catch (...) {
+				os.close();
+				std::remove(file.c_str());
+				throw;
+			}
+
+			os.close();
+			if (!os) {
+				std::remove(file.c_str());
+				throw std::runtime_error("Unable to write spill file \"" + file + "\"!");
+			}
+			std::remove(part.file.c_str());
+			part.file = file;
+		}
+	}
+}
+
+void RuleRun::release(FilterNative & outFilter) {
+	outFilter.reserve(outFilter.size() + numRules);
+	consume([&outFilter](FilterNative & chunk) {
+		outFilter.insert(outFilter.end(), chunk.begin(), chunk.end());
+		chunk.clear();
+	});
+}
+
+void RuleRun::freePart(Part & part) {
+	DeleteRules(part.rules);
+	if (spill) spill->release(part.memory);
+	part.memory = 0;
+	if (!part.file.empty()) std::remove(part.file.c_str());
+	part.file.clear();
+}
+
+void RuleRun::clear() {
+	for (auto & part : parts) freePart(part);
+	parts.clear();
+	numRules = 0;
+	numUseful = 0;
+}
+
+}
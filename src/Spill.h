@@ -0,0 +1,121 @@
+#ifndef IFPP_SPILL_H
+#define IFPP_SPILL_H
+
+#include "Types.h"
+#include "RuleNative.h"
+
+#include <atomic>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace ifpp {
+
+/*
+Keeps track of the memory used by rules held in runs, and of the files runs spill to.
+Shared by all the runs of a compilation, possibly from several threads.
+*/
+class SpillManager {
+public:
+	// The files are named base.spill<N>.
+	SpillManager(size_t limitBytes, const std::string & base) :
+		limit(limitBytes), fileBase(base), used(0), nextFile(0) {}
+	SpillManager(const SpillManager &) = delete;
+	SpillManager & operator=(const SpillManager &) = delete;
+
+	// Adds to the memory used, returns true if that is over the limit.
+	bool reserve(size_t bytes) { return (used += bytes) > limit; }
+	void release(size_t bytes) { used -= bytes; }
+
+	// Runs smaller than this are not worth a file of their own.
+	size_t minSpill() const { return limit / 64; }
+
+	// How much to read back from a file at a time.
+	size_t chunkBytes() const { return limit / 8 > 1 ? limit / 8 : 1; }
+
+	std::string newFile();
+
+private:
+	size_t limit;
+	std::string fileBase;
+	std::atomic<size_t> used;
+	std::atomic<unsigned> nextFile;
+};
+
+// Rough estimate of the memory taken by a rule, for deciding when to spill.
+size_t RuleMemory(const RuleNative * r);
+
+/*
+A sequence of rules which is only ever appended to, and then read in order.
+
+Without a spill manager this is just a vector of rules. With one, whenever the rules held in memory by all runs
+go over the memory limit, the rules this run holds in memory are written to a file (in the Serialize format) and deleted.
+Reading gives back all the rules in the original order, in chunks, so that a spilled run is never entirely in memory.
+
+A run owns its rules, and removes its files when they are no longer needed.
+*/
+class RuleRun {
+public:
+	explicit RuleRun(SpillManager * s = NULL) : parts(), spill(s), numRules(0), numUseful(0) {}
+	RuleRun(RuleRun && other);
+	RuleRun(const RuleRun &) = delete;
+	RuleRun & operator=(const RuleRun &) = delete;
+	~RuleRun() { clear(); }
+
+	SpillManager * spillManager() const { return spill; }
+
+	// Takes ownership of the rules.
+	void push(RuleNative * r);
+	void push(RulePtr r) { push(r.release()); }
+	void append(FilterNative & rules);
+	void append(RuleRun & other);
+
+	size_t size() const { return numRules; }
+	bool empty() const { return numRules == 0; }
+
+	// True if there are any rules which match something.
+	bool anyUseful() const { return numUseful > 0; }
+
+	/*
+	Passes all rules to f in order, a chunk at a time, and leaves the run empty.
+	f takes ownership of the rules it takes out of the chunk, or sets to NULL there.
+	Whatever it leaves in the chunk is deleted, also if it throws.
+	Chunks held in memory are passed whole, chunks read from files have at most about chunkBytes of rules.
+	*/
+	void consume(const std::function<void(FilterNative & chunk)> & f);
+
+	/*
+	Passes all rules to f in order, a chunk at a time. f can change the rules, but must not keep or remove any.
+	Spilled rules are written back, so the changes are kept.
+	*/
+	void update(const std::function<void(FilterNative & chunk)> & f);
+
+	// Moves all rules into the filter, reading back everything that was spilled.
+	void release(FilterNative & outFilter);
+
+	void clear();
+
+private:
+	struct Part {
+		Part() : rules(), file(), count(0), memory(0) {}
+		FilterNative rules; // If the part is in memory.
+		std::string file; // If the part was spilled.
+		size_t count;
+		size_t memory;
+	};
+
+	Part & tail();
+	void spillTail();
+	void writeFile(const std::string & file, const FilterNative & rules) const;
+	void readFile(const Part & part, const std::function<void(FilterNative & chunk)> & f) const;
+	void freePart(Part & part);
+
+	std::vector<Part> parts;
+	SpillManager * spill;
+	size_t numRules;
+	size_t numUseful;
+};
+
+}
+
+#endif
@@ -1,4 +1,5 @@
 #include "Types.h"
+#include "Arena.h"
 
 #include <stdexcept>
 #include <cstring>
@@ -89,6 +90,16 @@ std::ostream & operator<<(std::ostream & os, const NameList & nl) {
 	return os;
 }
 
+size_t NameListHash::operator()(const NameList & nl) const {
+	size_t h = nl.size();
+	for (const auto & s : nl) h = h * 31 + std::hash<std::string>()(s);
+	return h;
+}
+
+std::ostream & operator<<(std::ostream & os, const SharedNames & nl) {
+	return os << nl->names();
+}
+
 std::ostream & print(std::ostream & os, TagList t) {
 	if (t & TAG_OVERRIDE) os << "Override ";
 	if (t & TAG_FINAL) os << "Final ";
@@ -123,12 +134,107 @@ std::ostream & operator<<(std::ostream & os, Operator o) {
 	}
 }
 
+// Indexed by ConditionKind, so also sorted.
+static const std::string CONDITION_NAMES[CK_COUNT] = {
+	"AnyEnchantment",
+	"BaseType",
+	"Class",
+	"Corrupted",
+	"DropLevel",
+	"ElderItem",
+	"FracturedItem",
+	"GemLevel",
+	"HasEnchantment",
+	"HasExplicitMod",
+	"Height",
+	"Identified",
+	"ItemLevel",
+	"LinkedSockets",
+	"MapTier",
+	"Prophecy",
+	"Quality",
+	"Rarity",
+	"ShapedMap",
+	"ShaperItem",
+	"SocketGroup",
+	"Sockets",
+	"StackSize",
+	"SynthesisedItem",
+	"Width"
+};
+
+// Indexed by ActionKind, so also sorted.
+static const std::string ACTION_NAMES[AK_COUNT] = {
+	"CustomAlertSound",
+	"DisableDropSound",
+	"Hidden",
+	"MinimapIcon",
+	"PlayAlertSound",
+	"PlayAlertSoundPositional",
+	"PlayEffect",
+	"SetBackgroundColor",
+	"SetBorderColor",
+	"SetFontSize",
+	"SetTextColor"
+};
+
+// Indexed by BlockType.
+static const std::string BLOCK_NAMES[] = { "Group", "Rule", "ConditionGroup", "Modifier", "Default" };
+
+const std::string & ConditionName(ConditionKind k) {
+	return CONDITION_NAMES[k];
+}
+
+const std::string & ActionName(ActionKind k) {
+	return ACTION_NAMES[k];
+}
+
+const std::string & BlockName(BlockType bt) {
+	return BLOCK_NAMES[bt];
+}
+
+std::ostream & operator<<(std::ostream & os, ConditionKind k) {
+	return os << ConditionName(k);
+}
+
+std::ostream & operator<<(std::ostream & os, ActionKind k) {
+	return os << ActionName(k);
+}
+
+/***********
+* NODES
+***********/
+
+// Memory for a node of up to Size bytes.
+template<size_t Size>
+struct NodeMemory {
+	alignas(std::max_align_t) char data[Size];
+};
+
+/*
+Three size classes fit all nodes, from a bool condition to a minimap icon or a block.
+Anything larger (there should be nothing) comes from the heap.
+*/
+void * AllocateNode(size_t size) {
+	if (size <= 32) return Arena<NodeMemory<32> >::allocate();
+	if (size <= 64) return Arena<NodeMemory<64> >::allocate();
+	if (size <= 128) return Arena<NodeMemory<128> >::allocate();
+	return ::operator new(size);
+}
+
+void FreeNode(void * p, size_t size) {
+	if (size <= 32) Arena<NodeMemory<32> >::deallocate(p);
+	else if (size <= 64) Arena<NodeMemory<64> >::deallocate(p);
+	else if (size <= 128) Arena<NodeMemory<128> >::deallocate(p);
+	else ::operator delete(p);
+}
+
 /*
 Instructions
 */
 
 std::ostream & Instruction::printSelf(std::ostream & os) const {
-	return os << std::string(IFPP_TABS, '\t') << what;
+	return os << std::string(IFPP_TABS, '\t') << name();
 }
 
 /*
@@ -141,6 +247,11 @@ InstructionVersion * InstructionVersion::clone() const {
 }
 */
 
+const std::string & DefinitionBase::name() const {
+	static const std::string define("Define");
+	return define;
+}
+
 std::ostream & DefinitionBase::printSelf(std::ostream & os) const {
 	return Instruction::printSelf(os) << ' ' << varName << ' ' << varType;
 }
@@ -150,7 +261,7 @@ std::ostream & DefinitionBase::printSelf(std::ostream & os) const {
 ***********/
 
 std::ostream & Command::printSelf(std::ostream & os) const {
-	return os << std::string(IFPP_TABS, '\t') << what;
+	return os << std::string(IFPP_TABS, '\t') << name();
 }
 
 /***********
@@ -158,7 +269,8 @@ std::ostream & Command::printSelf(std::ostream & os) const {
 ***********/
 
 std::ostream & ConditionInterval::printSelf(std::ostream & os) const {
-	if (what == "Rarity") {
+	const std::string & what = name();
+	if (kind == CK_RARITY) {
 		if (from > to) throw InternalError("Condition " + what + " has inverted range!", __FILE__, __LINE__);
 		if (to < Normal || from > Unique) throw InternalError("Condition " + what + " does not match any value!", __FILE__, __LINE__);
 		if (from == INT_MIN && to == INT_MAX) throw InternalError("Condition " + what + " matches all possible values!", __FILE__, __LINE__);
@@ -185,7 +297,7 @@ std::ostream & ConditionInterval::printSelf(std::ostream & os) const {
 }
 
 ConditionInterval * ConditionInterval::clone() const {
-	return new ConditionInterval(what, from, to, tags);
+	return new ConditionInterval(kind, from, to, tags);
 }
 
 std::ostream & ConditionBool::printSelf(std::ostream & os) const {
@@ -193,7 +305,7 @@ std::ostream & ConditionBool::printSelf(std::ostream & os) const {
 }
 
 ConditionBool * ConditionBool::clone() const {
-	return new ConditionBool(what, value, tags);
+	return new ConditionBool(kind, value, tags);
 }
 
 std::ostream & ConditionNameList::printSelf(std::ostream & os) const {
@@ -201,7 +313,7 @@ std::ostream & ConditionNameList::printSelf(std::ostream & os) const {
 }
 
 ConditionNameList * ConditionNameList::clone() const {
-	return new ConditionNameList(what, nameList, tags);
+	return new ConditionNameList(kind, nameList, tags);
 }
 
 std::ostream & ConditionSocketGroup::printSelf(std::ostream & os) const {
@@ -209,7 +321,7 @@ std::ostream & ConditionSocketGroup::printSelf(std::ostream & os) const {
 }
 
 ConditionSocketGroup * ConditionSocketGroup::clone() const {
-	return new ConditionSocketGroup(what, socketGroup, tags);
+	return new ConditionSocketGroup(kind, socketGroup, tags);
 }
 
 
@@ -232,7 +344,7 @@ std::ostream & Block::printSelf(std::ostream & os) const {
 }
 
 Block * Block::clone() const {
-	auto cb = new Block(blockType, Command::what, tags);
+	auto cb = new Block(blockType, tags, line);
 	cb->commands.reserve(commands.size());
 	for (auto c : commands) cb->commands.push_back(c->clone());
 	return cb;
@@ -242,6 +354,11 @@ Block::~Block() {
 	for (auto c : commands) delete c;
 }
 
+const std::string & Ignore::name() const {
+	static const std::string ignore("DefaultIgnore");
+	return ignore;
+}
+
 std::ostream & Ignore::printSelf(std::ostream & os) const {
 	return Command::printSelf(os);
 }
@@ -250,33 +367,45 @@ Ignore * Ignore::clone() const {
 	return new Ignore(tags);
 }
 
+typedef std::map<std::string, std::pair<int, int> > LimitMap;
+typedef std::map<std::string, int> DefaultMap;
+
+static LimitMap makeLimits() {
+	LimitMap limits;
+	limits["ItemLevel"] = std::make_pair(1, 100);
+	limits["DropLevel"] = std::make_pair(1, 100);
+	limits["Quality"] = std::make_pair(0, 30);
+	limits["Sockets"] = std::make_pair(0, 6); // Kaom's stuff has 0 sockets
+	limits["LinkedSockets"] = std::make_pair(0, 6); // Kaom's stuff has 0 sockets
+	limits["Height"] = std::make_pair(1, 4);
+	limits["Width"] = std::make_pair(1, 2);
+	limits["StackSize"] = std::make_pair(1, 1000); // Perandus Coins?
+	limits["GemLevel"] = std::make_pair(1, 21); // Don't think you can go over this.
+	limits["Rarity"] = std::make_pair(1, 4); // Normal, Magic, Rare, Unique
+	limits["MapTier"] = std::make_pair(1, 16); // Shaper's Realm (T17) is not a map?
+
+	limits["SetFontSize"] = std::make_pair(17, 45); // https://www.pathofexile.com/forum/view-thread/2199068
+	limits["Color"] = std::make_pair(0, 255);
+	limits["Volume"] = std::make_pair(0, 300);
+	limits["MinimapIcon"] = std::make_pair(0, 2);
+	return limits;
+}
+
+static DefaultMap makeDefaults() {
+	DefaultMap defaults;
+	defaults["Color"] = 255;
+	defaults["Volume"] = 300; // LOUDER
+	defaults["FontSize"] = 33;
+	return defaults;
+}
+
+/*
+The tables are built on first use; initialization of function-local statics is thread-safe,
+so this can be called from several compiler threads at once.
+*/
 int getLimit(const std::string & what, WhichLimit which) {
-	static std::map<std::string, std::pair<int, int> > limits;
-	static std::map<std::string, int> defaults;
-	static bool first = true;
-	if (first) {
-		first = false;
-		limits["ItemLevel"] = std::make_pair(1, 100);
-		limits["DropLevel"] = std::make_pair(1, 100);
-		limits["Quality"] = std::make_pair(0, 30);
-		limits["Sockets"] = std::make_pair(0, 6); // Kaom's stuff has 0 sockets
-		limits["LinkedSockets"] = std::make_pair(0, 6); // Kaom's stuff has 0 sockets
-		limits["Height"] = std::make_pair(1, 4);
-		limits["Width"] = std::make_pair(1, 2);
-		limits["StackSize"] = std::make_pair(1, 1000); // Perandus Coins?
-		limits["GemLevel"] = std::make_pair(1, 21); // Don't think you can go over this.
-		limits["Rarity"] = std::make_pair(1, 4); // Normal, Magic, Rare, Unique
-		limits["MapTier"] = std::make_pair(1, 16); // Shaper's Realm (T17) is not a map?
-
-		limits["SetFontSize"] = std::make_pair(17, 45); // https://www.pathofexile.com/forum/view-thread/2199068
-		limits["Color"] = std::make_pair(0, 255);
-		limits["Volume"] = std::make_pair(0, 300);
-		limits["MinimapIcon"] = std::make_pair(0, 2);
-
-		defaults["Color"] = 255;
-		defaults["Volume"] = 300; // LOUDER
-		defaults["FontSize"] = 33;
-	}
+	static const LimitMap limits = makeLimits();
+	static const DefaultMap defaults = makeDefaults();
 	try {
 		switch (which) {
 			case MIN: return limits.at(what).first;
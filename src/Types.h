@@ -7,6 +7,9 @@
 #include <ostream>
 #include <climits>
 
+#include "Names.h"
+#include "Shared.h"
+
 namespace ifpp {
 
 struct InternalError : public std::logic_error {
@@ -74,9 +77,20 @@ struct SocketGroup {
 };
 std::ostream & operator<<(std::ostream & os, const SocketGroup & sg);
 
-typedef std::vector<std::string> NameList;
 std::ostream & operator<<(std::ostream & os, const NameList & nl);
 
+struct NameListHash {
+	size_t operator()(const NameList & nl) const;
+};
+
+/*
+Name lists are never changed once parsed, so they are shared: by list variables, the conditions using them,
+the copies of those conditions and the native rules made from them. Passing a list around never copies the names,
+and the index of the list (see NameSet) is built only once.
+*/
+typedef Shared<NameSet, NameListHash, NameList> SharedNames;
+std::ostream & operator<<(std::ostream & os, const SharedNames & nl);
+
 typedef unsigned int TagList;
 const unsigned int TAG_OVERRIDE = 	1 << 0;
 const unsigned int TAG_FINAL =		1 << 1;
@@ -100,6 +114,39 @@ enum ExprType { EXPR_NUMBER, EXPR_COLOR, EXPR_FILE, EXPR_LIST, EXPR_MACRO, EXPR_
 enum Operator { OP_LT, OP_LE, OP_EQ, OP_GE, OP_GT };
 std::ostream & operator<<(std::ostream & os, Operator o);
 
+/*
+Kinds of conditions and actions, assigned by the lexer.
+They are listed in alphabetical order of their names, which is the order they are written to native filters.
+*/
+enum ConditionKind {
+	CK_ANYENCHANTMENT, CK_BASETYPE, CK_CLASS, CK_CORRUPTED, CK_DROPLEVEL, CK_ELDERITEM, CK_FRACTUREDITEM,
+	CK_GEMLEVEL, CK_HASENCHANTMENT, CK_HASEXPLICITMOD, CK_HEIGHT, CK_IDENTIFIED, CK_ITEMLEVEL, CK_LINKEDSOCKETS,
+	CK_MAPTIER, CK_PROPHECY, CK_QUALITY, CK_RARITY, CK_SHAPEDMAP, CK_SHAPERITEM, CK_SOCKETGROUP, CK_SOCKETS,
+	CK_STACKSIZE, CK_SYNTHESISEDITEM, CK_WIDTH,
+	CK_COUNT
+};
+
+enum ActionKind {
+	AK_CUSTOMALERTSOUND, AK_DISABLEDROPSOUND, AK_HIDDEN, AK_MINIMAPICON, AK_PLAYALERTSOUND,
+	AK_PLAYALERTSOUNDPOSITIONAL, AK_PLAYEFFECT, AK_SETBACKGROUNDCOLOR, AK_SETBORDERCOLOR, AK_SETFONTSIZE, AK_SETTEXTCOLOR,
+	AK_COUNT
+};
+
+const std::string & ConditionName(ConditionKind k);
+const std::string & ActionName(ActionKind k);
+const std::string & BlockName(BlockType bt);
+std::ostream & operator<<(std::ostream & os, ConditionKind k);
+std::ostream & operator<<(std::ostream & os, ActionKind k);
+
+/*
+Instructions and commands (the nodes of the parsed filter) are allocated from arenas, one per size class,
+instead of one by one from the heap. Allocating and freeing a node is cheap (see Arena), and nodes allocated
+one after another, as the parser does, mostly come from the same chunk. They are still separate objects linked
+by pointers, and freed one by one. Freed slots are reused first, so nodes are not kept in the order they were parsed.
+*/
+void * AllocateNode(size_t size);
+void FreeNode(void * p, size_t size);
+
 /*
 Instructions:
 - Variable definition
@@ -108,9 +155,11 @@ Instructions:
 
 struct Instruction {
 	InstructionType insType;
-	std::string what;
 
-	Instruction(InstructionType t, const std::string & w) : insType(t), what(w) {}
+	Instruction(InstructionType t) : insType(t) {}
+	virtual const std::string & name() const = 0;
+	static void * operator new(size_t size) { return AllocateNode(size); }
+	static void operator delete(void * p, size_t size) { FreeNode(p, size); }
 	virtual std::ostream & printSelf(std::ostream & os) const;
 	virtual ~Instruction() {}
 	virtual Instruction * clone() const = 0;
@@ -132,7 +181,8 @@ struct DefinitionBase : public Instruction {
 	std::string varName;
 	ExprType varType;
 	DefinitionBase(const std::string & vn, ExprType et) :
-		Instruction(INS_DEFINITION, "Define"), varName(vn), varType(et) {}
+		Instruction(INS_DEFINITION), varName(vn), varType(et) {}
+	const std::string & name() const override;
 	virtual std::ostream & printSelf(std::ostream & os) const override;
 	virtual ~DefinitionBase() {}
 };
@@ -163,12 +213,14 @@ This can be:
 
 struct Command {
 	CommandType comType;
-	std::string what;
 	TagList tags;
 
-	Command(CommandType ct, const std::string & w, TagList t = 0) :
-		comType(ct), what(w), tags(t) {}
+	Command(CommandType ct, TagList t = 0) :
+		comType(ct), tags(t) {}
 	bool hasTag(TagList t) const { return tags & t; }
+	virtual const std::string & name() const = 0;
+	static void * operator new(size_t size) { return AllocateNode(size); }
+	static void operator delete(void * p, size_t size) { FreeNode(p, size); }
 	virtual std::ostream & printSelf(std::ostream & os) const;
 	virtual Command * clone() const = 0;
 	virtual ~Command() {}
@@ -179,8 +231,14 @@ template<>
 struct Definition<CommandList> : public DefinitionBase {
 	CommandList value;
 	
+	// The commands are copied, the context keeps its own list for expanding the macro.
 	Definition(const std::string & vn, ExprType et, const CommandList & v) :
-		DefinitionBase(vn, et), value(v) {}
+		DefinitionBase(vn, et), value() {
+		value.reserve(v.size());
+		for (auto c : v) value.push_back(c->clone());
+	}
+	Definition(const Definition<CommandList> &) = delete;
+	Definition<CommandList> & operator=(const Definition<CommandList> &) = delete;
 	std::ostream & printSelf(std::ostream & os) const override {
 		return DefinitionBase::printSelf(os) << ' ';
 		print(os, value) << std::endl;
@@ -199,17 +257,19 @@ struct Definition<CommandList> : public DefinitionBase {
 
 struct Condition : public Command {
 	ConditionType conType;
+	ConditionKind kind;
 
-	Condition(ConditionType ct, const std::string & w, TagList t = 0) :
-		Command(COM_CONDITION, w, t), conType(ct) {}
+	Condition(ConditionType ct, ConditionKind k, TagList t = 0) :
+		Command(COM_CONDITION, t), conType(ct), kind(k) {}
+	const std::string & name() const override { return ConditionName(kind); }
 	virtual Condition * clone() const override = 0;
 };
 
 struct ConditionInterval : public Condition {
 	int from, to;
 
-	ConditionInterval(const std::string & w, int f, int T, TagList t = 0) :
-		Condition(CON_INTERVAL, w, t), from(f), to(T) {}
+	ConditionInterval(ConditionKind k, int f, int T, TagList t = 0) :
+		Condition(CON_INTERVAL, k, t), from(f), to(T) {}
 	std::ostream & printSelf(std::ostream & os) const override;
 	ConditionInterval * clone() const override;
 };
@@ -217,17 +277,17 @@ struct ConditionInterval : public Condition {
 struct ConditionBool : public Condition {
 	bool value;
 
-	ConditionBool(const std::string & w, bool v, TagList t = 0) :
-		Condition(CON_BOOL, w, t), value(v) {}
+	ConditionBool(ConditionKind k, bool v, TagList t = 0) :
+		Condition(CON_BOOL, k, t), value(v) {}
 	std::ostream & printSelf(std::ostream & os) const override;
 	ConditionBool * clone() const override;
 };
 
 struct ConditionNameList : public Condition {
-	NameList nameList;
+	SharedNames nameList;
 
-	ConditionNameList(const std::string & w, const NameList & nl, TagList t = 0) :
-		Condition(CON_NAMELIST, w, t), nameList(nl) {}
+	ConditionNameList(ConditionKind k, const SharedNames & nl, TagList t = 0) :
+		Condition(CON_NAMELIST, k, t), nameList(nl) {}
 	std::ostream & printSelf(std::ostream & os) const override;
 	ConditionNameList * clone() const override;
 };
@@ -235,8 +295,8 @@ struct ConditionNameList : public Condition {
 struct ConditionSocketGroup : public Condition {
 	SocketGroup socketGroup;
 
-	ConditionSocketGroup(const std::string & w, const SocketGroup & sg, TagList t = 0) :
-		Condition(CON_SOCKETGROUP, w, t), socketGroup(sg) {}
+	ConditionSocketGroup(ConditionKind k, const SocketGroup & sg, TagList t = 0) :
+		Condition(CON_SOCKETGROUP, k, t), socketGroup(sg) {}
 	std::ostream & printSelf(std::ostream & os) const override;
 	ConditionSocketGroup * clone() const override;
 };
@@ -248,8 +308,11 @@ struct ConditionSocketGroup : public Condition {
 ***********/
 
 struct Action : public Command {
-	Action(const std::string & w, TagList t = 0) :
-		Command(COM_ACTION, w, t) {}
+	ActionKind kind;
+
+	Action(ActionKind k, TagList t = 0) :
+		Command(COM_ACTION, t), kind(k) {}
+	const std::string & name() const override { return ActionName(kind); }
 	virtual Action * clone() const override = 0;
 };
 
@@ -257,13 +320,13 @@ template<class T1>
 struct Action1 : public Action {
 	T1 arg1;
 
-	Action1(const std::string & w, const T1 & a1, TagList t = 0) :
-		Action(w, t), arg1(a1) {}
+	Action1(ActionKind k, const T1 & a1, TagList t = 0) :
+		Action(k, t), arg1(a1) {}
 	std::ostream & printSelf(std::ostream & os) const override {
 		return Action::printSelf(os) << ' ' << arg1 << std::endl;
 	}
 	Action1<T1> * clone() const override {
-		return new Action1<T1>(what, arg1, tags);
+		return new Action1<T1>(kind, arg1, tags);
 	}
 };
 
@@ -271,12 +334,12 @@ template<>
 struct Action1<bool> : public Action {
 	bool arg1;
 
-	Action1(const std::string & w, const bool & a1, TagList t = 0) :
-		Action(w, t), arg1(a1) {}
+	Action1(ActionKind k, const bool & a1, TagList t = 0) :
+		Action(k, t), arg1(a1) {}
 	std::ostream & printSelf(std::ostream & os) const override {
 		// Do not print Hidden to native filters, this is handled in compiler.
 		// However it is impractical to remove this action.
-		if (what == "Hidden") return os;
+		if (kind == AK_HIDDEN) return os;
 		if (arg1) {
 			// Print this action if it is true.
 			return Action::printSelf(os) << std::endl;
@@ -286,7 +349,7 @@ struct Action1<bool> : public Action {
 		}
 	}
 	Action1<bool> * clone() const override {
-		return new Action1<bool>(what, arg1, tags);
+		return new Action1<bool>(kind, arg1, tags);
 	}
 };
 
@@ -295,13 +358,13 @@ struct Action2 : public Action {
 	T1 arg1;
 	T2 arg2;
 
-	Action2(const std::string & w, const T1 & a1, const T2 & a2, TagList t = 0) :
-		Action(w, t), arg1(a1), arg2(a2) {}
+	Action2(ActionKind k, const T1 & a1, const T2 & a2, TagList t = 0) :
+		Action(k, t), arg1(a1), arg2(a2) {}
 	std::ostream & printSelf(std::ostream & os) const override {
 		return Action::printSelf(os) << ' ' << arg1 << ' ' << arg2 << std::endl;
 	}
 	Action2<T1, T2> * clone() const override {
-		return new Action2<T1, T2>(what, arg1, arg2, tags);
+		return new Action2<T1, T2>(kind, arg1, arg2, tags);
 	}
 };
 
@@ -311,24 +374,24 @@ struct Action3 : public Action {
 	T2 arg2;
 	T3 arg3;
 
-	Action3(const std::string & w, const T1 & a1, const T2 & a2, const T3 & a3, TagList t = 0) :
-		Action(w, t), arg1(a1), arg2(a2) , arg3(a3) {}
+	Action3(ActionKind k, const T1 & a1, const T2 & a2, const T3 & a3, TagList t = 0) :
+		Action(k, t), arg1(a1), arg2(a2) , arg3(a3) {}
 	std::ostream & printSelf(std::ostream & os) const override {
 		return Action::printSelf(os) << ' ' << arg1 << ' ' << arg2 << ' ' << arg3 << std::endl;
 	}
 	Action3<T1, T2, T3> * clone() const override {
-		return new Action3<T1, T2, T3>(what, arg1, arg2, arg3, tags);
+		return new Action3<T1, T2, T3>(kind, arg1, arg2, arg3, tags);
 	}
 };
 
 struct ActionRemove : public Action {
-	ActionRemove(const std::string & w, TagList t) :
-		Action (w, t | TAG_REMOVE) {}
+	ActionRemove(ActionKind k, TagList t) :
+		Action (k, t | TAG_REMOVE) {}
 	std::ostream & printSelf(std::ostream & os) const override {
 		return os; //Action::printSelf(os) << " Removed" << std::endl;
 	}
 	ActionRemove * clone() const override {
-		return new ActionRemove(what, tags);
+		return new ActionRemove(kind, tags);
 	}
 };
 
@@ -343,18 +406,24 @@ typedef Action3<int, std::string, std::string> ActionMapIcon;
 struct Block : public Instruction, public Command {
 	BlockType blockType;
 	CommandList commands;
-
-	Block(BlockType bt, const std::string & w, TagList t = 0) :
-		Instruction(INS_BLOCK, w), Command(COM_BLOCK, w, t), blockType(bt), commands() {}
-	Block(BlockType bt, const std::string & w, const CommandList & c, TagList t = 0) :
-		Instruction(INS_BLOCK, w), Command(COM_BLOCK, w, t), blockType(bt), commands(c) {}
+	int line; // Line of the input file where the block starts, 0 if not known. Used in messages.
+
+	Block(BlockType bt, TagList t = 0, int l = 0) :
+		Instruction(INS_BLOCK), Command(COM_BLOCK, t), blockType(bt), commands(), line(l) {}
+	Block(BlockType bt, const CommandList & c, TagList t = 0, int l = 0) :
+		Instruction(INS_BLOCK), Command(COM_BLOCK, t), blockType(bt), commands(c), line(l) {}
+	const std::string & name() const override { return BlockName(blockType); }
+	// Both bases have these, so say which ones a block uses.
+	using Command::operator new;
+	using Command::operator delete;
 	std::ostream & printSelf(std::ostream & os) const override;
 	Block * clone() const override;
 	~Block() override;
 };
 
 struct Ignore : public Command {
-	Ignore(TagList t = 0) : Command(COM_IGNORE, "DefaultIgnore", t) {}
+	Ignore(TagList t = 0) : Command(COM_IGNORE, t) {}
+	const std::string & name() const override;
 	std::ostream & printSelf(std::ostream & os) const override;
 	Ignore * clone() const override;
 };
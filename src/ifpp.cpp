@@ -2,6 +2,9 @@
 #include "Logger.h"
 #include "Context.h"
 #include "Compiler.h"
+#include "Pipeline.h"
+#include "Shards.h"
+#include "Optimizer.h"
 
 // Autogenerated files are not super strict.
 #pragma GCC diagnostic push
@@ -16,14 +19,58 @@
 #include <string>
 #include <sstream>
 #include <stdexcept>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <memory>
 
 #include <shlobj.h>
 
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
+
 extern const int IFPP_VERSION_MAJOR = 2;
 extern const int IFPP_VERSION_MINOR = 1;
 extern const int IFPP_VERSION_PATCH = 0;
 const char * POE_VERSION = "3.6";
 
+// Cancelled by Ctrl+C, the compiler stops at its next check and the partial output is removed.
+static ifpp::CancelToken interrupted;
+
+static void OnInterrupt(int) {
+	interrupted.cancel();
+	// If the compiler does not stop, another Ctrl+C kills the process the usual way.
+	signal(SIGINT, SIG_DFL);
+}
+
+/*
+Draws a progress bar on the console, always over the same line.
+*/
+static void PrintProgress(const ifpp::CompileProgress & p) {
+	const size_t width = 30;
+	size_t filled = p.blocksTotal > 0 ? static_cast<size_t>(width * p.blocksWorked / p.blocksTotal) : width;
+
+	std::cerr << "\r[" << std::string(filled, '#') << std::string(width - filled, '.') << "] "
+		<< p.blocksDone << '/' << p.blocksTotal << " blocks, " << p.rulesGenerated << " rules";
+	if (p.secondsRemaining >= 0) std::cerr << ", about " << static_cast<int>(p.secondsRemaining + 0.5) << "s left";
+	std::cerr << "    " << std::flush;
+}
+
+/*
+All rules have been written and deleted, give their memory back at once.
+Rules still alive here were leaked by somebody. Not worth aborting for, their memory is freed at exit anyway.
+*/
+static void ReleaseRules(ifpp::Logger & log) {
+	size_t alive = ifpp::Arena<ifpp::RuleNative>::release();
+	if (alive > 0) {
+		log.warning() << "Internal: " << alive << " native rules are still alive after writing the filter, "
+			<< "their memory was not released." << std::endl;
+	}
+}
+
 int main(int argc, char ** argv) {
 	std::string inFile(""), outFile(""), logFile("");
 	/*
@@ -56,6 +103,12 @@ int main(int argc, char ** argv) {
 	bool dPartial = false;
 	bool dParseOnly = false;*/
 	bool documents = false;
+	bool stream = false;
+	bool pipelined = false;
+	bool progress = false;
+	ifpp::ShardOptions shards;
+	shards.workerCommand = std::string("\"") + argv[0] + "\"";
+	ifpp::CompilerOptions options;
 
 	for (int i = 1; i < argc; ++i) {
 		/*
@@ -68,6 +121,35 @@ int main(int argc, char ** argv) {
 		
 		// TODO: give a method to specify i/o/l files separately
 		if (!strcmp(argv[i], "-d")) documents = true;
+		else if (!strcmp(argv[i], "-j") && i + 1 < argc) {
+			// -j 0 uses all available cores.
+			options.threads = atoi(argv[++i]);
+			if (options.threads <= 0) options.threads = std::thread::hardware_concurrency();
+			if (options.threads <= 0) options.threads = 1;
+		}
+		else if (!strcmp(argv[i], "--max-rules") && i + 1 < argc) options.maxRules = strtoull(argv[++i], NULL, 10);
+		else if (!strcmp(argv[i], "--max-block-rules") && i + 1 < argc) options.maxBlockRules = strtoull(argv[++i], NULL, 10);
+		else if (!strcmp(argv[i], "--warn-rules")) options.warnRules = true;
+		else if (!strcmp(argv[i], "--remove-duplicates")) options.removeDuplicates = true;
+		else if (!strcmp(argv[i], "--remove-shadowed")) options.removeShadowed = true;
+		else if (!strcmp(argv[i], "--merge-rules")) options.mergeRules = true;
+		else if (!strcmp(argv[i], "--stream")) stream = true;
+		else if (!strcmp(argv[i], "--pipeline")) pipelined = true;
+		else if (!strcmp(argv[i], "--progress")) progress = true;
+		else if (!strcmp(argv[i], "--workers") && i + 1 < argc) shards.workers = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "--memory-limit") && i + 1 < argc) {
+			// In megabytes.
+			options.memoryLimit = strtoull(argv[++i], NULL, 10) << 20;
+		}
+		else if (!strcmp(argv[i], "--worker") && i + 1 < argc) {
+			// Started by another ifpp to compile one shard, see Shards.h. The result goes to stdout.
+#ifdef _WIN32
+			_setmode(_fileno(stdout), _O_BINARY);
+#endif
+			// Ctrl+C reaches the workers too, they stop like the coordinator instead of dying halfway through.
+			signal(SIGINT, OnInterrupt);
+			return ifpp::RunWorker(argv[i + 1], std::cout, &interrupted);
+		}
 		else if (inFile == "") inFile = argv[i];
 		else if (outFile == "") outFile = argv[i];
 		else if (logFile == "") logFile = argv[i];
@@ -75,7 +157,8 @@ int main(int argc, char ** argv) {
 
 	if (inFile == "") {
 		std::cerr << "Error: No input file specified. Nothing to do." << std::endl;
-		std::cerr << "Use: ifpp <input file> [output file] [log file]." << std::endl;
+		std::cerr << "Use: ifpp [-d] [-j threads] [--stream | --pipeline | --workers N] [--memory-limit MB] [--progress] [--max-rules N] [--max-block-rules N] [--warn-rules] [--remove-duplicates] [--remove-shadowed] [--merge-rules]"
+			<< " <input file> [output file] [log file]." << std::endl;
 		return EXIT_FAILURE;
 	}
 
@@ -94,6 +177,27 @@ int main(int argc, char ** argv) {
 		}
 	}
 	ifpp::Logger log(logFile == "-" ? std::cerr : logStream);
+
+	options.cancel = &interrupted;
+	signal(SIGINT, OnInterrupt);
+
+	// Rules over the memory limit spill to files next to the output. This only helps if the output is streamed.
+	options.spillBase = outFile;
+	if (options.memoryLimit > 0) {
+		if (pipelined || shards.workers > 0) {
+			log.warning() << "The memory limit is only supported when streaming, using --stream instead." << std::endl;
+		}
+		stream = true;
+		pipelined = false;
+		shards.workers = 0;
+	}
+
+	// The pipeline does not know how many blocks are coming, and the workers are separate processes.
+	if (progress && (pipelined || shards.workers > 0)) {
+		log.warning() << "Progress is not reported with --pipeline or --workers." << std::endl;
+		progress = false;
+	}
+	if (progress) options.progress = PrintProgress;
 	
 	
 	/*
@@ -114,7 +218,31 @@ int main(int argc, char ** argv) {
 		ifpp::Context ctx(inFile, inFilter, log);
 		
 		ctx.reset();
-		ctx.parse();
+
+		// In the pipeline mode blocks are compiled and written while the rest of the file is still being parsed.
+		std::ofstream pipelineStream;
+		std::unique_ptr<ifpp::Pipeline> pipeline;
+		// Do not leave a partial filter behind, whatever fails once the output is open.
+		// The pipeline has to stop writing before the file is removed.
+		auto removePipelineOutput = [&pipeline, &pipelineStream, &outFile]() {
+			pipeline.reset();
+			pipelineStream.close();
+			std::remove(outFile.c_str());
+		};
+		if (pipelined) {
+			pipelineStream.open(outFile, std::ios_base::out);
+			pipeline.reset(new ifpp::Pipeline(log, options, pipelineStream));
+			ctx.setBlockSink([&pipeline](ifpp::Block * block) { pipeline->push(block); });
+			if (options.threads > 1) log.message() << "Using " << options.threads << " threads." << std::endl;
+			log.message() << "Compiling filter and writing it to \"" << outFile << "\" while parsing..." << std::endl;
+		}
+
+		try {
+			ctx.parse();
+		} catch (...) {
+			if (pipelined) removePipelineOutput();
+			throw;
+		}
 		
 		log.message() << "Parsing finished." << std::endl;
 		log.message() << "\t" << ctx.countDef << " definitions" << std::endl;
@@ -141,24 +269,87 @@ int main(int argc, char ** argv) {
 		std::ofstream partialStream;
 		if (dPartial) partialStream.open(baseName + ".partial.ifpp", std::ios_base::out);
 */	
-		ifpp::Compiler c(log);
-		
-		log.message() << "Compiler initialized." << std::endl;
-		log.message() << "Compiling filter..." << std::endl;
-		c.Compile(outFilter, inFilter);
-		log.message() << "Compiling done." << std::endl;
-		log.message() << "\tGenerated " << outFilter.size() << " native rules." << std::endl << std::endl;
-		
+		if (pipelined) {
+			try {
+				pipeline->finish();
+			} catch (...) {
+				removePipelineOutput();
+				throw;
+			}
+			pipelineStream.close();
+			log.message() << "Compiling done." << std::endl;
+			pipeline->optimizations().report(log);
+			const size_t numRules = pipeline->numRules();
+			// The optimizer of the pipeline keeps copies of rules.
+			pipeline.reset();
+			ReleaseRules(log);
+			log.message() << "\tGenerated " << numRules << " native rules." << std::endl << std::endl;
+		} else if (stream) {
+			log.message() << "Compiler initialized." << std::endl;
+			if (options.threads > 1) log.message() << "Using " << options.threads << " threads." << std::endl;
+
+			// Every top-level block is written out as soon as it is compiled.
+			log.message() << "Compiling filter and writing it to \"" << outFile << "\"..." << std::endl;
+			std::ofstream outStream(outFile, std::ios_base::out);
+			size_t numRules = 0;
+			// The optimizer keeps copies of rules, so it has to be gone before their memory is released.
+			std::unique_ptr<ifpp::OutputOptimizer> optimizer(new ifpp::OutputOptimizer(options));
+			ifpp::Compiler c(log, options);
+			try {
+				c.Compile(inFilter, [&outStream, &numRules, &optimizer](ifpp::FilterNative & rules) {
+					optimizer->filter(rules);
+					ifpp::print(outStream, rules);
+					numRules += rules.size();
+				});
+				ifpp::FilterNative rest;
+				optimizer->finish(rest);
+				ifpp::print(outStream, rest);
+				numRules += rest.size();
+				for (const auto r : rest) delete r;
+				if (progress) std::cerr << std::endl;
+			} catch (...) {
+				// Do not leave a partial filter behind.
+				outStream.close();
+				std::remove(outFile.c_str());
+				throw;
+			}
+			outStream.close();
+			log.message() << "Compiling done." << std::endl;
+			optimizer->report(log);
+			optimizer.reset();
+			ReleaseRules(log);
+			log.message() << "\tGenerated " << numRules << " native rules." << std::endl << std::endl;
+		} else {
+			log.message() << "Compiler initialized." << std::endl;
+			if (options.threads > 1) log.message() << "Using " << options.threads << " threads." << std::endl;
+			log.message() << "Compiling filter..." << std::endl;
+			if (shards.workers > 0) {
+				log.message() << "Using " << shards.workers << " worker processes." << std::endl;
+				shards.tempBase = outFile;
+				ifpp::CompileSharded(outFilter, inFilter, log, options, shards);
+			} else {
+				ifpp::Compiler c(log, options);
+				c.Compile(outFilter, inFilter);
+				if (progress) std::cerr << std::endl;
+			}
+			log.message() << "Compiling done." << std::endl;
+			ifpp::OutputOptimizer optimizer(options);
+			optimizer.filter(outFilter);
+			optimizer.finish(outFilter);
+			optimizer.report(log);
+			log.message() << "\tGenerated " << outFilter.size() << " native rules." << std::endl << std::endl;
+			
 /*
-		if (dPartial) partialStream.close();
+			if (dPartial) partialStream.close();
 */
 
-		// Write the native filter to output.
-	
-		log.message() << "Writing native filter to \"" << outFile << "\"..." << std::endl;
-		std::ofstream outStream(outFile, std::ios_base::out);
-		ifpp::print(outStream, outFilter);
-		outStream.close();
+			// Write the native filter to output.
+		
+			log.message() << "Writing native filter to \"" << outFile << "\"..." << std::endl;
+			std::ofstream outStream(outFile, std::ios_base::out);
+			ifpp::print(outStream, outFilter);
+			outStream.close();
+		}
 
 		// Copy the filter to the Path of Exile folder under My Documents.		
 		
@@ -181,7 +372,13 @@ int main(int argc, char ** argv) {
 			
 			log.message() << "Writing native filter to \"" << docFile << "\"..." << std::endl;
 			std::ofstream docStream(docFile, std::ios_base::out);
-			ifpp::print(docStream, outFilter);
+			if (stream || pipelined) {
+				// The rules are gone by now, copy the output file instead.
+				std::ifstream outStream(outFile, std::ios_base::in);
+				docStream << outStream.rdbuf();
+			} else {
+				ifpp::print(docStream, outFilter);
+			}
 			docStream.close();
 		}
 		
@@ -202,6 +399,14 @@ int main(int argc, char ** argv) {
 		logStream.close();
 		return EXIT_FAILURE;
 	}
+	catch (ifpp::CompileCancelled & e) {
+		// Do not continue the progress bar.
+		if (progress) std::cerr << std::endl;
+		log.error() << e.what() << std::endl;
+		log.message() << "Processing aborted.";
+		logStream.close();
+		return EXIT_FAILURE;
+	}
 	catch (std::runtime_error & e) {
 		log.error() << e.what() << std::endl;
 		log.message() << "Processing aborted.";